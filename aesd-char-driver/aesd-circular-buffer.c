@@ -31,62 +31,176 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t remaining_offset = char_offset;
-    size_t current_out_offs_offset = 0;
-    bool char_found = false;
-    do
+    if (char_offset >= buffer->total_size)
     {
-        if (buffer->entry[buffer->out_offs + current_out_offs_offset].buffptr == NULL)
+        return NULL;
+    }
+
+    // Binary search the entry start offsets for the last entry starting at or before the target
+    size_t target = aesd_circular_buffer_base_offset(buffer) + char_offset;
+    size_t low = 0;
+    size_t high = aesd_circular_buffer_entry_count(buffer) - 1;
+    while (low < high)
+    {
+        size_t mid = low + (high - low + 1) / 2;
+        if (aesd_circular_buffer_entry_at(buffer, mid)->offset <= target)
         {
-            return NULL;
-        }
-        if (remaining_offset >= buffer->entry[buffer->out_offs + current_out_offs_offset].size) {
-            remaining_offset -= buffer->entry[buffer->out_offs + current_out_offs_offset].size;
-            current_out_offs_offset++;
-            if (buffer->out_offs + current_out_offs_offset >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-            {
-                current_out_offs_offset = -1 * buffer->out_offs;
-            }
-            if (current_out_offs_offset == 0)
-            {
-                return NULL;
-            }
+            low = mid;
         }
         else
         {
-            *entry_offset_byte_rtn = remaining_offset;
-            char_found = true;
+            high = mid - 1;
         }
-    } while (!char_found);
-    return &(buffer->entry[buffer->out_offs + current_out_offs_offset]);
+    }
+
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, low);
+    *entry_offset_byte_rtn = target - entry->offset;
+    return entry;
+}
+
+/**
+ * @param buffer the buffer to index.  Any necessary locking must be performed by caller.
+ * @param index the zero referenced entry number, 0 being the oldest entry still stored
+ * @return the entry, or NULL if fewer than @param index + 1 entries are stored.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, size_t index)
+{
+    if (index >= aesd_circular_buffer_entry_count(buffer))
+    {
+        return NULL;
+    }
+    index += buffer->out_offs;
+    if (index >= buffer->capacity)
+    {
+        index -= buffer->capacity;
+    }
+    return &(buffer->entry[index]);
+}
+
+/**
+ * @return the stream offset of the oldest byte still stored in @param buffer, counting every byte
+ * ever added.  Subtracting it from an entry's offset gives the entry's char_offset.
+ * Any necessary locking must be performed by caller.
+ */
+size_t aesd_circular_buffer_base_offset(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->end_offset - buffer->total_size;
+}
+
+/**
+ * @param buffer the buffer the entry belongs to.  Any necessary locking must be performed by caller.
+ * @param entry an entry returned by aesd_circular_buffer_find_entry_offset_for_fpos or a previous call
+ * @return the entry written after @param entry, or NULL if @param entry is the most recent one.
+ * Lets callers walk the remaining entries in order without searching from the start again.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry)
+{
+    size_t index = (entry - buffer->entry) + 1;
+    if (index >= buffer->capacity)
+    {
+        index = 0;
+    }
+    if (index == buffer->in_offs)
+    {
+        return NULL;
+    }
+    return &(buffer->entry[index]);
+}
+
+/**
+ * @return the number of entries currently stored in @param buffer.
+ * Any necessary locking must be performed by caller.
+ */
+size_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+    {
+        return buffer->capacity;
+    }
+    if (buffer->in_offs >= buffer->out_offs)
+    {
+        return buffer->in_offs - buffer->out_offs;
+    }
+    return buffer->in_offs + buffer->capacity - buffer->out_offs;
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
 * new start location.
+* The stored entry's offset is set to the running end_offset, which keeps the entry offsets sorted
+* so lookups by position are binary searches.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    if (buffer->full)
+    {
+        buffer->total_size -= buffer->entry[buffer->in_offs].size;
+    }
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry[buffer->in_offs].offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
+    buffer->total_size += add_entry->size;
     buffer->in_offs += 1;
-    if (buffer->in_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    if (buffer->in_offs >= buffer->capacity)
     {
-        buffer->full = true;
         buffer->in_offs = 0;
     }
     if (buffer->full)
     {
         buffer->out_offs = buffer->in_offs;
     }
+    else if (buffer->in_offs == buffer->out_offs)
+    {
+        buffer->full = true;
+    }
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Removes the oldest entry from @param buffer and copies it to @param removed_entry.
+* Used to evict entries before the buffer is full, for instance to respect a byte budget.
+* Any necessary locking must be handled by the caller, as must freeing the removed entry's memory.
+* @return false if the buffer was empty.
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry)
+{
+    if (aesd_circular_buffer_entry_count(buffer) == 0)
+    {
+        return false;
+    }
+    *removed_entry = buffer->entry[buffer->out_offs];
+    buffer->total_size -= removed_entry->size;
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    buffer->out_offs += 1;
+    if (buffer->out_offs >= buffer->capacity)
+    {
+        buffer->out_offs = 0;
+    }
+    buffer->full = false;
+    return true;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct using
+* @param capacity entries of caller provided storage at @param entries.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            size_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    memset(entries,0,capacity * sizeof(struct aesd_buffer_entry));
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
+*/
+void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_init_storage(buffer, buffer->default_entry, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
 }
@@ -16,6 +16,10 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of entries held by a buffer set up with aesd_circular_buffer_init.  Buffers set up with
+ * aesd_circular_buffer_init_storage hold as many entries as the caller provides.
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -28,6 +32,11 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Stream offset of the first byte, counting every byte ever added to the buffer.
+     * Set by aesd_circular_buffer_add_entry.
+     */
+    size_t offset;
 };
 
 struct aesd_circular_buffer
@@ -35,27 +44,103 @@ struct aesd_circular_buffer
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of elements in the entry array
+     */
+    size_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    size_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    size_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Sum of the sizes of all stored entries
+     */
+    size_t total_size;
+    /**
+     * Stream offset one past the last byte of the newest entry
+     */
+    size_t end_offset;
+    /**
+     * Entry storage used by aesd_circular_buffer_init
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+/**
+ * Layout of the read-only view returned by mmap() on the aesdchar device.
+ *
+ * The mapping starts with a struct aesd_mmap_header followed by entry_capacity
+ * struct aesd_mmap_entry slots.  The retained bytes live in a ring of data_size bytes starting
+ * data_offset bytes into the mapping; the byte at stream offset X is stored at
+ * data_offset + (X % data_size).  Entries i = 0..entry_count-1, oldest first, are in slot
+ * (first_entry + i) % entry_capacity.  Only entries whose bytes are all still in the data ring
+ * are listed.
+ *
+ * The driver updates the view in place.  sequence is odd while an update is in progress: read
+ * it, read the table and data, then read sequence again and retry if it is odd or has changed.
+ */
+#define AESD_MMAP_MAGIC 0x44534541  /* "AESD" little endian */
+#define AESD_MMAP_VERSION 1
+
+struct aesd_mmap_entry
+{
+    /**
+     * Stream offset of the first byte of the entry, see aesd_buffer_entry.offset
+     */
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct aesd_mmap_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Update counter, odd while the driver is modifying the view
+     */
+    uint64_t sequence;
+    /**
+     * Number of entries committed since the device was loaded
+     */
+    uint64_t generation;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t entry_capacity;
+    uint32_t entry_count;
+    uint32_t first_entry;
+    uint32_t reserved;
+    struct aesd_mmap_entry entries[];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer, size_t index);
+
+extern size_t aesd_circular_buffer_base_offset(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_next_entry(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry);
+
+extern size_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry);
+
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entries,
+            size_t capacity);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -63,9 +148,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a size_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * size_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +159,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
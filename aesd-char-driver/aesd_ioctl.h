@@ -33,14 +33,95 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Describes the retained entries, filled by AESDCHAR_IOCQENTRIES
+ */
+struct aesd_entry_table {
+    /**
+     * User space pointer to an array of sizes_capacity uint64_t which receives the size of each
+     * entry, oldest first.  May be 0 to only query the counters below.
+     */
+    uint64_t sizes_ptr;
+    uint32_t sizes_capacity;
+    /**
+     * Set by the driver to the number of retained entries, which may exceed sizes_capacity
+     */
+    uint32_t entry_count;
+    /**
+     * Set by the driver to the sum of all retained entry sizes
+     */
+    uint64_t total_bytes;
+    /**
+     * Set by the driver to the stream offset of the oldest retained byte, counting every byte
+     * ever written to the device
+     */
+    uint64_t base_offset;
+    /**
+     * Set by the driver to the number of entries committed since the device was loaded
+     */
+    uint64_t generation;
+    /**
+     * Set by the driver to a random number chosen when the device was loaded.  Stream offsets
+     * are only comparable between two reports with the same epoch.
+     */
+    uint64_t epoch;
+};
+
+/**
+ * One positioned read of an AESDCHAR_IOCBATCHREAD request
+ */
+struct aesd_batch_op {
+    /**
+     * Where to start reading, as for AESDCHAR_IOCSEEKTO
+     */
+    struct aesd_seekto seekto;
+    /**
+     * User space pointer to buf_len bytes receiving data read from seekto onwards, across
+     * entry boundaries
+     */
+    uint64_t buf_ptr;
+    uint32_t buf_len;
+    uint32_t reserved;
+    /**
+     * Set by the driver to the number of bytes read, or a negative errno
+     */
+    int64_t result;
+};
+
+/**
+ * A batch of positioned reads served from one consistent view of the buffer.
+ * The file position is not changed.
+ */
+struct aesd_batch {
+    /**
+     * User space pointer to op_count struct aesd_batch_op
+     */
+    uint64_t ops_ptr;
+    uint32_t op_count;
+    uint32_t reserved;
+};
+
+/**
+ * The maximum number of operations accepted in one AESDCHAR_IOCBATCHREAD
+ */
+#define AESDCHAR_BATCH_MAX_OPS 256
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Return the entry table in one call, command number 2
+#define AESDCHAR_IOCQENTRIES _IOWR(AESD_IOC_MAGIC, 2, struct aesd_entry_table)
+// Perform a batch of positioned reads, command number 3
+#define AESDCHAR_IOCBATCHREAD _IOWR(AESD_IOC_MAGIC, 3, struct aesd_batch)
+// Enable (non-zero) or disable (zero) follow mode on this open file, command number 4.
+// In follow mode a read at the end of the history waits for the next write instead of
+// returning 0, or fails with EAGAIN when the file is O_NONBLOCK.
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 4, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
 
 #endif /* AESD_IOCTL_H */
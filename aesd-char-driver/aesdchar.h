@@ -32,9 +32,26 @@ struct aesd_dev
      */
     struct aesd_circular_buffer circular_buffer;
     struct aesd_buffer_entry current_entry;
-    struct mutex device_mutex;
+    char *spare_buffer;       /* evicted entry buffer kept for the next write, protected by write_mutex */
+    struct mutex write_mutex;          /* protects current_entry and spare_buffer */
+    struct rw_semaphore buffer_lock;   /* shared by readers, exclusive for append and evict */
+    u64 generation;                    /* entries committed since load */
+    u64 epoch;                         /* random, identifies this load's history */
+    struct aesd_mmap_header *mmap_view; /* vmalloc_user region handed to mmap, NULL if disabled */
+    size_t mmap_view_size;
+    wait_queue_head_t readers_wait;    /* woken whenever an entry is committed */
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *device;
+    bool follow;          /* set by AESDCHAR_IOCFOLLOW, reads at the end wait for new entries */
+    size_t pos_base;      /* stream offset f_pos 0 referred to at the last read or seek, follow mode only */
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -17,6 +17,17 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/random.h>
+#include <linux/version.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
@@ -25,122 +36,602 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Brett Lange"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static unsigned int aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_entries, "Number of completed writes retained by the device");
+
+static unsigned long aesd_max_bytes = 0;
+module_param(aesd_max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_max_bytes, "Evict the oldest writes once retained data exceeds this many bytes (0 = no limit)");
+
+// Opt-in: while the view exists every commit copies the entry into it under the write lock
+static unsigned long aesd_mmap_bytes = 0;
+module_param(aesd_mmap_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(aesd_mmap_bytes, "Size of the data ring in the mmap view (0 = no mmap view)");
+
+static unsigned int aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, S_IRUGO);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar minors, each with its own history");
+
+// One per minor, indexed by minor number
+struct aesd_dev *aesd_devices;
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
-    /**
-     * TODO: handle open
-     */
-    filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    struct aesd_file *file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (file == NULL)
+    {
+	    return -ENOMEM;
+    }
+    file->device = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
-    /**
-     * TODO: handle release
-     */
+    kfree(filp->private_data);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * In follow mode f_pos is relative to the oldest entry as of the last read or seek.  Move it
+ * onto the current oldest entry so evictions in between do not make the reader skip or repeat
+ * data; a position that was evicted restarts at the oldest retained byte.
+ * Called with buffer_lock held.
+ */
+static loff_t aesd_follow_rebase(struct aesd_file *file, loff_t pos)
+{
+    size_t base = aesd_circular_buffer_base_offset(&file->device->circular_buffer);
+    size_t stream_pos = file->pos_base + pos;
+    file->pos_base = base;
+    return stream_pos > base ? stream_pos - base : 0;
+}
+
+/**
+ * @return true once data was committed past @param pos, checked without buffer_lock as the
+ * wait condition of a follower.
+ */
+static bool aesd_follow_readable(struct aesd_file *file, loff_t pos)
+{
+    return READ_ONCE(file->device->circular_buffer.end_offset) > file->pos_base + pos;
+}
+
+/**
+ * Iterator based read so the device can be the source of splice() and sendfile(), which lets
+ * aesdsocket hand the history to a socket without copying it through user space.
+ * Fills the whole destination, spanning as many circular buffer entries as needed,
+ * starting at iocb->ki_pos.
+ * At the end of the history a follow mode reader sleeps until the next entry is committed,
+ * or gets -EAGAIN when non-blocking; other readers see end of file.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
 
-    struct aesd_dev *device = filp->private_data;
-    int err = mutex_lock_interruptible(&device->device_mutex);
-    if (err != 0)
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *device = file->device;
+    while (true)
     {
-	    return err;
-    }
+	    // Readers only share the buffer lock, so concurrent reads proceed in parallel
+	    int err = down_read_killable(&device->buffer_lock);
+	    if (err != 0)
+	    {
+		    return err;
+	    }
+	    if (!file->follow || iov_iter_count(to) == 0)
+	    {
+		    break;
+	    }
+	    iocb->ki_pos = aesd_follow_rebase(file, iocb->ki_pos);
+	    if (iocb->ki_pos < device->circular_buffer.total_size)
+	    {
+		    break;
+	    }
+	    up_read(&device->buffer_lock);
 
-    ssize_t offset = 0;
-    struct aesd_buffer_entry *new_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&device->circular_buffer, *f_pos, &offset);
-    if (new_entry != NULL)
-    {
-	    ssize_t num_chars = new_entry->size - offset;
-	    
-	    if (num_chars > count)
+	    if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
 	    {
-		    num_chars = count;
+		    return -EAGAIN;
 	    }
-	    
-	    err = copy_to_user(buf, new_entry->buffptr + offset, num_chars);
-	    
+	    err = wait_event_interruptible(device->readers_wait, aesd_follow_readable(file, iocb->ki_pos));
 	    if (err != 0)
 	    {
-		    mutex_unlock(&device->device_mutex);
 		    return err;
 	    }
-	    *f_pos += num_chars;
-	    retval = num_chars;
     }
 
-    mutex_unlock(&device->device_mutex);
+    size_t offset = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&device->circular_buffer, iocb->ki_pos, &offset);
+    while (entry != NULL && iov_iter_count(to) > 0)
+    {
+	    size_t num_chars = min(entry->size - offset, iov_iter_count(to));
+	    size_t copied = copy_to_iter(entry->buffptr + offset, num_chars, to);
+	    iocb->ki_pos += copied;
+	    retval += copied;
+	    if (copied != num_chars)
+	    {
+		    if (retval == 0)
+		    {
+			    retval = -EFAULT;
+		    }
+		    break;
+	    }
+	    offset = 0;
+	    entry = aesd_circular_buffer_next_entry(&device->circular_buffer, entry);
+    }
+
+    up_read(&device->buffer_lock);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * The device is always writable.  It is readable when a read would not block: always for
+ * ordinary readers, which see end of file, and once data follows f_pos in follow mode.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
 {
-    ssize_t retval = -ENOMEM;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-    /**
-     * TODO: handle write
-     */
-    struct aesd_dev *device = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
 
-    int err = mutex_lock_interruptible(&device->device_mutex);
-    if (err != 0)
+    poll_wait(filp, &file->device->readers_wait, wait);
+    if (!file->follow || aesd_follow_readable(file, filp->f_pos))
     {
-	    return err;
+	    mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+/**
+ * Entry buffers come from a few size classes of dedicated slab caches, larger ones from
+ * kvmalloc.  A small header in front of the data records where the buffer came from and how
+ * much it can hold, so buffptr can be freed or reused without extra bookkeeping.
+ */
+struct aesd_entry_buf
+{
+    size_t capacity;
+    int cache_index;  /* index into aesd_entry_caches, -1 for kvmalloc */
+    char data[];
+};
+
+static const size_t aesd_entry_cache_sizes[] = { 128, 512, 2048, 8192 };
+static struct kmem_cache *aesd_entry_caches[ARRAY_SIZE(aesd_entry_cache_sizes)];
+
+// Evicted buffers larger than this are released rather than kept as the spare
+#define AESD_SPARE_MAX_CAPACITY (64 * 1024)
+
+static struct aesd_entry_buf *aesd_entry_buf(const char *buffptr)
+{
+    return container_of((char *)buffptr, struct aesd_entry_buf, data[0]);
+}
+
+static size_t aesd_entry_capacity(const char *buffptr)
+{
+    return buffptr == NULL ? 0 : aesd_entry_buf(buffptr)->capacity;
+}
+
+static void aesd_entry_free(const char *buffptr)
+{
+    if (buffptr == NULL)
+    {
+	    return;
+    }
+    struct aesd_entry_buf *buf = aesd_entry_buf(buffptr);
+    if (buf->cache_index < 0)
+    {
+	    kvfree(buf);
+    }
+    else
+    {
+	    kmem_cache_free(aesd_entry_caches[buf->cache_index], buf);
+    }
+}
+
+/**
+ * @return the index of the slab cache for a buffer of @param size bytes, -1 for kvmalloc, and
+ * the number of bytes allocated for it, header included, in @param alloc_size.
+ */
+static int aesd_entry_class(size_t size, size_t *alloc_size)
+{
+    *alloc_size = sizeof(struct aesd_entry_buf) + size;
+    for (int i = 0; i < ARRAY_SIZE(aesd_entry_cache_sizes); i++)
+    {
+	    if (*alloc_size <= aesd_entry_cache_sizes[i])
+	    {
+		    *alloc_size = aesd_entry_cache_sizes[i];
+		    return i;
+	    }
+    }
+    // kvmalloc hands out whole pages at this size, let the capacity say so
+    *alloc_size = PAGE_ALIGN(*alloc_size);
+    return -1;
+}
+
+/**
+ * @return a buffer holding at least @param size bytes.  The device's spare buffer is reused
+ * only when it is of the size class a new allocation would get, so no buffer holds more memory
+ * than its size calls for.  Must be called with write_mutex held.
+ */
+static char *aesd_entry_alloc(struct aesd_dev *device, size_t size)
+{
+    size_t alloc_size = 0;
+    int cache_index = aesd_entry_class(size, &alloc_size);
+    if (device->spare_buffer != NULL &&
+        aesd_entry_capacity(device->spare_buffer) == alloc_size - sizeof(struct aesd_entry_buf))
+    {
+	    char *buffptr = device->spare_buffer;
+	    device->spare_buffer = NULL;
+	    return buffptr;
+    }
+
+    struct aesd_entry_buf *buf = NULL;
+    if (cache_index < 0)
+    {
+	    buf = kvmalloc(alloc_size, GFP_KERNEL);
+    }
+    else
+    {
+	    buf = kmem_cache_alloc(aesd_entry_caches[cache_index], GFP_KERNEL);
+    }
+    if (buf == NULL)
+    {
+	    return NULL;
+    }
+    buf->capacity = alloc_size - sizeof(struct aesd_entry_buf);
+    buf->cache_index = cache_index;
+    return buf->data;
+}
+
+/**
+ * Keep a buffer that is no longer needed as the spare for the next allocation, or free it.
+ * The newest eviction replaces the spare, as the next write most likely has a similar size.
+ * Must be called with write_mutex held.
+ */
+static void aesd_entry_recycle(struct aesd_dev *device, const char *buffptr)
+{
+    if (buffptr == NULL)
+    {
+	    return;
+    }
+    if (aesd_entry_capacity(buffptr) > AESD_SPARE_MAX_CAPACITY)
+    {
+	    aesd_entry_free(buffptr);
+	    return;
+    }
+    aesd_entry_free(device->spare_buffer);
+    device->spare_buffer = (char *)buffptr;
+}
+
+static void aesd_entry_caches_destroy(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(aesd_entry_caches); i++)
+    {
+	    kmem_cache_destroy(aesd_entry_caches[i]);
+	    aesd_entry_caches[i] = NULL;
     }
-    
-    char *temp_buff = kmalloc(device->current_entry.size + count, GFP_KERNEL);
-    if (temp_buff == NULL)
+}
+
+static int aesd_entry_caches_create(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(aesd_entry_caches); i++)
     {
-	    mutex_unlock(&device->device_mutex);
-	    return retval;
+	    char name[32];
+	    snprintf(name, sizeof(name), "aesd_entry_%zu", aesd_entry_cache_sizes[i]);
+	    // Reads copy entry data straight to user space, whitelist it for hardened usercopy
+	    size_t size = aesd_entry_cache_sizes[i];
+	    aesd_entry_caches[i] = kmem_cache_create_usercopy(name, size, 0, 0, offsetof(struct aesd_entry_buf, data),
+	                                                      size - offsetof(struct aesd_entry_buf, data), NULL);
+	    if (aesd_entry_caches[i] == NULL)
+	    {
+		    aesd_entry_caches_destroy();
+		    return -ENOMEM;
+	    }
     }
-    
-    if (device->current_entry.buffptr != NULL)
+    return 0;
+}
+
+/**
+ * Allocate the page backed region exported by aesd_mmap, sized for aesd_mmap_bytes of data.
+ */
+static int aesd_mmap_view_init(struct aesd_dev *device)
+{
+    size_t table_size = sizeof(struct aesd_mmap_header) +
+                        device->circular_buffer.capacity * sizeof(struct aesd_mmap_entry);
+    size_t data_offset = PAGE_ALIGN(table_size);
+    size_t data_size = PAGE_ALIGN(aesd_mmap_bytes);
+
+    if (data_size == 0)
+    {
+	    return 0;
+    }
+    device->mmap_view = vmalloc_user(data_offset + data_size);
+    if (device->mmap_view == NULL)
     {
-	    memcpy(temp_buff, device->current_entry.buffptr, device->current_entry.size);
-	    kfree(device->current_entry.buffptr);
+	    return -ENOMEM;
     }
-    device->current_entry.buffptr = temp_buff;
-    err = copy_from_user(device->current_entry.buffptr + device->current_entry.size, buf, count);
+    device->mmap_view_size = data_offset + data_size;
+    device->mmap_view->magic = AESD_MMAP_MAGIC;
+    device->mmap_view->version = AESD_MMAP_VERSION;
+    device->mmap_view->data_offset = data_offset;
+    device->mmap_view->data_size = data_size;
+    device->mmap_view->entry_capacity = device->circular_buffer.capacity;
+    return 0;
+}
+
+/**
+ * Mirror a newly added entry and any evictions into the mmap view.
+ * Must be called with buffer_lock held for writing, after the entry was added.
+ * @param slot the index in circular_buffer.entry the new entry was stored at
+ */
+static void aesd_mmap_view_update(struct aesd_dev *device, size_t slot)
+{
+    struct aesd_mmap_header *view = device->mmap_view;
+    struct aesd_circular_buffer *buffer = &device->circular_buffer;
+    struct aesd_buffer_entry *entry = &buffer->entry[slot];
+
+    if (view == NULL)
+    {
+	    return;
+    }
+
+    WRITE_ONCE(view->sequence, view->sequence + 1);
+    smp_wmb();
+
+    // Copy the entry into the data ring, only its tail if it is larger than the ring
+    char *data = (char *)view + view->data_offset;
+    size_t copy_size = min_t(size_t, entry->size, view->data_size);
+    size_t stream_offset = entry->offset + entry->size - copy_size;
+    const char *src = entry->buffptr + entry->size - copy_size;
+    while (copy_size > 0)
+    {
+	    size_t ring_offset = stream_offset % view->data_size;
+	    size_t chunk = min_t(size_t, copy_size, view->data_size - ring_offset);
+	    memcpy(data + ring_offset, src, chunk);
+	    src += chunk;
+	    stream_offset += chunk;
+	    copy_size -= chunk;
+    }
+    view->entries[slot].offset = entry->offset;
+    view->entries[slot].size = entry->size;
+
+    // List the entries from the oldest one still completely held in the data ring
+    size_t base = aesd_circular_buffer_base_offset(buffer);
+    size_t limit = base;
+    if (buffer->end_offset - base > view->data_size)
+    {
+	    limit = buffer->end_offset - view->data_size;
+    }
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry *first = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, limit - base, &entry_offset);
+    if (first != NULL && entry_offset != 0)
+    {
+	    first = aesd_circular_buffer_next_entry(buffer, first);
+    }
+    if (first == NULL)
+    {
+	    view->first_entry = buffer->in_offs;
+	    view->entry_count = 0;
+    }
+    else
+    {
+	    size_t first_slot = first - buffer->entry;
+	    view->first_entry = first_slot;
+	    view->entry_count = (buffer->in_offs + buffer->capacity - first_slot - 1) % buffer->capacity + 1;
+    }
+    view->generation = device->generation;
+
+    smp_wmb();
+    WRITE_ONCE(view->sequence, view->sequence + 1);
+}
+
+/**
+ * Map the read-only history view described by struct aesd_mmap_header.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *device = ((struct aesd_file *)filp->private_data)->device;
+    size_t length = vma->vm_end - vma->vm_start;
+
+    if (device->mmap_view == NULL)
+    {
+	    return -ENODEV;
+    }
+    if (vma->vm_flags & VM_WRITE)
+    {
+	    return -EACCES;
+    }
+    if (vma->vm_pgoff != 0 || length > device->mmap_view_size)
+    {
+	    return -EINVAL;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, device->mmap_view, 0);
+}
+
+/**
+ * Move a completed write command into the circular buffer, freeing the entry it overwrites and,
+ * when aesd_max_bytes is set, the oldest entries beyond the byte budget.  The newest entry is
+ * always kept.  Entries are allocated at the size class of their own size, so retained memory is
+ * bounded by aesd_max_bytes plus one write, up to the rounding of the classes.
+ * Evicted buffers are recycled for later writes.
+ * Must be called with write_mutex held, takes buffer_lock exclusively for the append and
+ * eviction only.
+ */
+static void aesd_commit_entry(struct aesd_dev *device, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = buffptr, .size = size };
+
+    down_write(&device->buffer_lock);
+    size_t slot = device->circular_buffer.in_offs;
+    if (device->circular_buffer.full)
+    {
+	    aesd_entry_recycle(device, device->circular_buffer.entry[slot].buffptr);
+    }
+    aesd_circular_buffer_add_entry(&device->circular_buffer, &entry);
+    device->generation++;
+
+    while (aesd_max_bytes != 0 && device->circular_buffer.total_size > aesd_max_bytes &&
+           aesd_circular_buffer_entry_count(&device->circular_buffer) > 1)
+    {
+	    struct aesd_buffer_entry evicted;
+	    aesd_circular_buffer_remove_oldest(&device->circular_buffer, &evicted);
+	    aesd_entry_recycle(device, evicted.buffptr);
+    }
+    aesd_mmap_view_update(device, slot);
+    up_write(&device->buffer_lock);
+    wake_up_interruptible_poll(&device->readers_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+/**
+ * @return the number of bytes in @param from up to and including the next newline, or all of
+ * them if there is none, with @param found telling which.  The data is looked at through a small
+ * window on the stack and the iterator is left where it was, so the line can then be copied
+ * once into a buffer of its final size.
+ */
+static size_t aesd_scan_line(struct iov_iter *from, bool *found)
+{
+    char window[256];
+    size_t scanned = 0;
+    *found = false;
+    while (iov_iter_count(from) > 0)
+    {
+	    size_t chunk = copy_from_iter(window, min_t(size_t, sizeof(window), iov_iter_count(from)), from);
+	    char *newline = memchr(window, '\n', chunk);
+	    if (newline != NULL)
+	    {
+		    iov_iter_revert(from, scanned + chunk);
+		    *found = true;
+		    return scanned + (newline - window) + 1;
+	    }
+	    scanned += chunk;
+	    if (chunk == 0)
+	    {
+		    // Faulted, the copy of the data reports it
+		    break;
+	    }
+    }
+    iov_iter_revert(from, scanned);
+    return iov_iter_count(from);
+}
+
+/**
+ * Commit the pending bytes followed by the next @param size bytes of @param from, which end in a
+ * newline, as one entry.  Must be called with write_mutex held.
+ */
+static int aesd_write_line(struct aesd_dev *device, struct iov_iter *from, size_t size)
+{
+    size_t pending_size = device->current_entry.size;
+    char *buffptr = aesd_entry_alloc(device, pending_size + size);
+    if (buffptr == NULL)
+    {
+	    return -ENOMEM;
+    }
+    if (copy_from_iter(buffptr + pending_size, size, from) != size)
+    {
+	    aesd_entry_recycle(device, buffptr);
+	    return -EFAULT;
+    }
+    if (pending_size > 0)
+    {
+	    memcpy(buffptr, device->current_entry.buffptr, pending_size);
+	    aesd_entry_recycle(device, device->current_entry.buffptr);
+	    memset(&device->current_entry, 0, sizeof(struct aesd_buffer_entry));
+    }
+    aesd_commit_entry(device, buffptr, pending_size + size);
+    return 0;
+}
+
+/**
+ * Add the next @param size bytes of @param from, which hold no newline, to the pending entry.
+ * Its buffer grows geometrically so a line built from many small writes costs O(length) overall.
+ * Must be called with write_mutex held.
+ */
+static int aesd_write_pending(struct aesd_dev *device, struct iov_iter *from, size_t size)
+{
+    size_t pending_size = device->current_entry.size;
+    char *buffptr = (char *)device->current_entry.buffptr;
+    size_t pending_capacity = aesd_entry_capacity(buffptr);
+    if (pending_size + size > pending_capacity)
+    {
+	    buffptr = aesd_entry_alloc(device, max(pending_size + size, 2 * pending_capacity));
+	    if (buffptr == NULL)
+	    {
+		    return -ENOMEM;
+	    }
+	    if (pending_size > 0)
+	    {
+		    memcpy(buffptr, device->current_entry.buffptr, pending_size);
+	    }
+	    aesd_entry_recycle(device, device->current_entry.buffptr);
+	    device->current_entry.buffptr = buffptr;
+    }
+    if (copy_from_iter(buffptr + pending_size, size, from) != size)
+    {
+	    return -EFAULT;
+    }
+    device->current_entry.size = pending_size + size;
+    return 0;
+}
+
+/**
+ * Iterator based write.  Every newline completes an entry, so one writev() carrying several
+ * packets adds one entry per packet, each copied once from the iterator into a buffer of its
+ * own size.  An unterminated tail stays pending until a later write completes it.
+ * If a line cannot be stored, the bytes taken before it are reported as a short write and
+ * the rest is left to the caller, so nothing is committed that the caller was told failed.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t count = iov_iter_count(from);
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
+
+    struct aesd_dev *device = ((struct aesd_file *)iocb->ki_filp->private_data)->device;
+    if (count == 0)
+    {
+	    return 0;
+    }
+
+    // write_mutex only protects the pending entry, readers are not blocked while it fills
+    int err = mutex_lock_interruptible(&device->write_mutex);
     if (err != 0)
     {
-	    mutex_unlock(&device->device_mutex);
 	    return err;
     }
-    device->current_entry.size += count;
-    if (temp_buff[device->current_entry.size - 1] == '\n')
+
+    ssize_t retval = 0;
+    while (iov_iter_count(from) > 0)
     {
-	    if (device->circular_buffer.full)
+	    bool complete = false;
+	    size_t size = aesd_scan_line(from, &complete);
+	    err = complete ? aesd_write_line(device, from, size) : aesd_write_pending(device, from, size);
+	    if (err != 0)
 	    {
-		    kfree(device->circular_buffer.entry[device->circular_buffer.in_offs].buffptr);
+		    if (retval == 0)
+		    {
+			    retval = err;
+		    }
+		    break;
 	    }
-	    aesd_circular_buffer_add_entry(&device->circular_buffer, &device->current_entry);
-	    memset(&device->current_entry, 0, sizeof(struct aesd_buffer_entry));
+	    retval += size;
     }
-    retval = count;
-    mutex_unlock(&device->device_mutex);
+    mutex_unlock(&device->write_mutex);
 
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) 
 {    
-    struct aesd_dev *device = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *device = file->device;
 
-    ssize_t retval = mutex_lock_interruptible(&device->device_mutex);
+    ssize_t retval = down_read_killable(&device->buffer_lock);
     if (retval != 0)
     {
         return -EINVAL;
@@ -156,35 +647,10 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
             newpos = filp->f_pos + offset;
             break;
         case SEEK_END:
-            ssize_t buffer_size = 0;
-            ssize_t num_entries = 0;
-            if (device->circular_buffer.full)
-            {
-                num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            }
-            else
-            {
-                num_entries = device->circular_buffer.in_offs - device->circular_buffer.out_offs;
-                if (num_entries < 0)
-                {
-                    num_entries += AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                }
-            }
-
-            ssize_t current_index = device->circular_buffer.out_offs;
-            for (int i = 0; i < num_entries; i++)
-            {
-                buffer_size += device->circular_buffer.entry[current_index].size;
-                ++current_index;
-                if (current_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-                {
-                    current_index = 0;
-                }
-            }
-            newpos = buffer_size + offset;
+            newpos = device->circular_buffer.total_size + offset;
             break;
         default:
-            mutex_unlock(&device->device_mutex);
+            up_read(&device->buffer_lock);
             PDEBUG("ERROR: Bad whence for llseek: %d", whence);
             return -EINVAL;
     }
@@ -192,21 +658,141 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
     PDEBUG("setting newpos...");
     if (newpos < 0)
     {
-        mutex_unlock(&device->device_mutex);
+        up_read(&device->buffer_lock);
         PDEBUG("ERROR: Negative new position: %d", newpos);
         return -EINVAL;
     }
     filp->f_pos = newpos;
-    mutex_unlock(&device->device_mutex);
+    file->pos_base = aesd_circular_buffer_base_offset(&device->circular_buffer);
+    up_read(&device->buffer_lock);
 
     return newpos;
 }
 
+/**
+ * Copy up to @param count bytes starting @param offset bytes into @param entry, continuing into
+ * the following entries, to @param buf.  Must be called with buffer_lock held.
+ * @return the number of bytes copied or -EFAULT.
+ */
+static ssize_t aesd_copy_entries_to_user(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *entry,
+                                         size_t offset, char __user *buf, size_t count)
+{
+    ssize_t copied = 0;
+    while (entry != NULL && count > 0)
+    {
+        size_t num_chars = min(entry->size - offset, count);
+        if (copy_to_user(buf + copied, entry->buffptr + offset, num_chars) != 0)
+        {
+            return -EFAULT;
+        }
+        copied += num_chars;
+        count -= num_chars;
+        offset = 0;
+        entry = aesd_circular_buffer_next_entry(buffer, entry);
+    }
+    return copied;
+}
+
+/**
+ * AESDCHAR_IOCQENTRIES: report the entry sizes and counters in one call.
+ * Must be called with buffer_lock held.
+ */
+static long aesd_ioctl_entry_table(struct aesd_dev *device, void __user *arg)
+{
+    struct aesd_circular_buffer *buffer = &device->circular_buffer;
+    struct aesd_entry_table table;
+    if (copy_from_user(&table, arg, sizeof(struct aesd_entry_table)) != 0)
+    {
+        return -EFAULT;
+    }
+
+    size_t num_entries = aesd_circular_buffer_entry_count(buffer);
+    table.entry_count = num_entries;
+    table.total_bytes = buffer->total_size;
+    table.base_offset = aesd_circular_buffer_base_offset(buffer);
+    table.generation = device->generation;
+    table.epoch = device->epoch;
+
+    size_t num_sizes = min_t(size_t, num_entries, table.sizes_capacity);
+    if (table.sizes_ptr != 0 && num_sizes > 0)
+    {
+        // Gather the sizes first so user space gets them in a single copy
+        u64 *sizes = kvmalloc_array(num_sizes, sizeof(u64), GFP_KERNEL);
+        if (sizes == NULL)
+        {
+            return -ENOMEM;
+        }
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, 0);
+        for (size_t i = 0; i < num_sizes; i++)
+        {
+            sizes[i] = entry->size;
+            entry = aesd_circular_buffer_next_entry(buffer, entry);
+        }
+        unsigned long err = copy_to_user(u64_to_user_ptr(table.sizes_ptr), sizes, num_sizes * sizeof(u64));
+        kvfree(sizes);
+        if (err != 0)
+        {
+            return -EFAULT;
+        }
+    }
+
+    if (copy_to_user(arg, &table, sizeof(struct aesd_entry_table)) != 0)
+    {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/**
+ * AESDCHAR_IOCBATCHREAD: perform each positioned read in the batch against the same buffer
+ * state.  Must be called with buffer_lock held.
+ * @return the number of operations performed, each op's result says whether it succeeded.
+ */
+static long aesd_ioctl_batch_read(struct aesd_dev *device, void __user *arg)
+{
+    struct aesd_batch batch;
+    if (copy_from_user(&batch, arg, sizeof(struct aesd_batch)) != 0)
+    {
+        return -EFAULT;
+    }
+    if (batch.op_count > AESDCHAR_BATCH_MAX_OPS)
+    {
+        return -EINVAL;
+    }
+
+    struct aesd_batch_op __user *user_ops = u64_to_user_ptr(batch.ops_ptr);
+    for (u32 i = 0; i < batch.op_count; i++)
+    {
+        struct aesd_batch_op op;
+        if (copy_from_user(&op, &user_ops[i], sizeof(struct aesd_batch_op)) != 0)
+        {
+            return -EFAULT;
+        }
+
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(&device->circular_buffer, op.seekto.write_cmd);
+        if (entry == NULL || entry->size <= op.seekto.write_cmd_offset)
+        {
+            op.result = -EINVAL;
+        }
+        else
+        {
+            op.result = aesd_copy_entries_to_user(&device->circular_buffer, entry, op.seekto.write_cmd_offset,
+                                                  u64_to_user_ptr(op.buf_ptr), op.buf_len);
+        }
+
+        if (put_user(op.result, &user_ops[i].result) != 0)
+        {
+            return -EFAULT;
+        }
+    }
+    return batch.op_count;
+}
+
 long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct aesd_dev *device = filp->private_data;
-    long newpos = 0;
-    ssize_t retval = mutex_lock_interruptible(&device->device_mutex);
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *device = file->device;
+    long retval = down_read_killable(&device->buffer_lock);
     if (retval != 0)
     {
         return -EINVAL;
@@ -216,77 +802,79 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     {
         case (AESDCHAR_IOCSEEKTO):
             struct aesd_seekto seekto;
-            ssize_t retval = copy_from_user(&seekto, (const void __user *)arg, sizeof(struct aesd_seekto));
-            if (retval != 0)
+            if (copy_from_user(&seekto, (const void __user *)arg, sizeof(struct aesd_seekto)) != 0)
             {
-                mutex_unlock(&device->device_mutex);
+                up_read(&device->buffer_lock);
                 return -EINVAL;
             }
 
-            ssize_t num_entries = 0;
-            if (device->circular_buffer.full)
-            {
-                num_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            }
-            else
-            {
-                num_entries = device->circular_buffer.in_offs - device->circular_buffer.out_offs;
-                if (num_entries < 0)
-                {
-                    num_entries += AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-                }
-            }
-
-            if (seekto.write_cmd >= num_entries)
+            // Entry offsets are absolute, so the position is found without walking the ring
+            struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(&device->circular_buffer, seekto.write_cmd);
+            if (entry == NULL || entry->size <= seekto.write_cmd_offset)
             {
-                mutex_unlock(&device->device_mutex);
+                up_read(&device->buffer_lock);
                 return -EINVAL;
             }
 
-            ssize_t current_index = device->circular_buffer.out_offs;
-            for (int i = 0; i < seekto.write_cmd; i++)
-            {
-                newpos += device->circular_buffer.entry[current_index].size;
-                ++current_index;
-                if (current_index >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-                {
-                    current_index = 0;
-                }
-            }
+            retval = entry->offset - aesd_circular_buffer_base_offset(&device->circular_buffer);
+            retval += seekto.write_cmd_offset;
+            filp->f_pos = retval;
+            file->pos_base = aesd_circular_buffer_base_offset(&device->circular_buffer);
 
-            if (device->circular_buffer.entry[current_index].size <= seekto.write_cmd_offset)
+            break;
+        case (AESDCHAR_IOCQENTRIES):
+            retval = aesd_ioctl_entry_table(device, (void __user *)arg);
+            break;
+        case (AESDCHAR_IOCBATCHREAD):
+            retval = aesd_ioctl_batch_read(device, (void __user *)arg);
+            break;
+        case (AESDCHAR_IOCFOLLOW):
+            uint32_t follow;
+            if (copy_from_user(&follow, (const void __user *)arg, sizeof(follow)) != 0)
             {
-                mutex_unlock(&device->device_mutex);
-                return -EINVAL;
+                up_read(&device->buffer_lock);
+                return -EFAULT;
             }
-
-            newpos += seekto.write_cmd_offset;
-            filp->f_pos = newpos;
-
+            // f_pos keeps its meaning, from here on relative to the current oldest entry
+            file->follow = follow != 0;
+            file->pos_base = aesd_circular_buffer_base_offset(&device->circular_buffer);
+            retval = 0;
             break;
         default:
             PDEBUG("ERROR: Bad cmd for aesd_unlocked_ioctl: %d", cmd);
-            mutex_unlock(&device->device_mutex);
+            up_read(&device->buffer_lock);
             return -EINVAL;
     }
 
-    mutex_unlock(&device->device_mutex);
-    return newpos;
+    up_read(&device->buffer_lock);
+    return retval;
 }
 
 struct file_operations aesd_fops = {
     .owner          = THIS_MODULE,
-    .read           = aesd_read,
-    .write          = aesd_write,
+    .read_iter      = aesd_read_iter,
+    .write_iter     = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read    = copy_splice_read,
+#else
+    .splice_read    = generic_file_splice_read,
+#endif
     .open           = aesd_open,
     .release        = aesd_release,
     .llseek         = aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+    // The ioctl structs are padded to the same layout for 32-bit and 64-bit callers, only the
+    // argument pointer needs converting
+    .compat_ioctl   = compat_ptr_ioctl,
+#endif
+    .mmap           = aesd_mmap,
+    .poll           = aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -298,30 +886,97 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     return err;
 }
 
+/**
+ * Set up the circular buffer, locks and mmap view of one minor and register its cdev.
+ */
+static int aesd_device_init(struct aesd_dev *device, int index)
+{
+    struct aesd_buffer_entry *entries = kcalloc(aesd_max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (entries == NULL) {
+        return -ENOMEM;
+    }
 
+    mutex_init(&device->write_mutex);
+    init_rwsem(&device->buffer_lock);
+    init_waitqueue_head(&device->readers_wait);
+    // Offsets restart at 0 on every load, the epoch tells clients their offsets are stale
+    device->epoch = get_random_u64();
+    aesd_circular_buffer_init_storage(&device->circular_buffer, entries, aesd_max_entries);
+    int result = aesd_mmap_view_init(device);
+    if (result == 0) {
+        result = aesd_setup_cdev(device, index);
+    }
+
+    if( result ) {
+        vfree(device->mmap_view);
+        kfree(entries);
+        mutex_destroy(&device->write_mutex);
+    }
+    return result;
+}
+
+static void aesd_device_cleanup(struct aesd_dev *device)
+{
+    cdev_del(&device->cdev);
+
+    size_t i = 0;
+    struct aesd_buffer_entry *entry = NULL;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &device->circular_buffer, i)
+    {
+	    aesd_entry_free(entry->buffptr);
+    }
+    kfree(device->circular_buffer.entry);
+    aesd_entry_free(device->current_entry.buffptr);
+    aesd_entry_free(device->spare_buffer);
+    vfree(device->mmap_view);
+    mutex_destroy(&device->write_mutex);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if (aesd_nr_devs == 0 || aesd_max_entries == 0) {
+        printk(KERN_WARNING "aesd_nr_devs and aesd_max_entries must be at least 1\n");
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    mutex_init(&aesd_device.device_mutex);
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
+    result = aesd_entry_caches_create();
+    if (result) {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return result;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL) {
+        aesd_entry_caches_destroy();
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    for (unsigned int i = 0; i < aesd_nr_devs; i++) {
+        result = aesd_device_init(&aesd_devices[i], i);
+        if (result) {
+            while (i-- > 0) {
+                aesd_device_cleanup(&aesd_devices[i]);
+            }
+            kfree(aesd_devices);
+            aesd_devices = NULL;
+            aesd_entry_caches_destroy();
+            unregister_chrdev_region(dev, aesd_nr_devs);
+            return result;
+        }
     }
-    return result;
+    return 0;
 
 }
 
@@ -329,21 +984,13 @@ void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
-    cdev_del(&aesd_device.cdev);
-
-    uint8_t i = 0;
-    struct aesd_buffer_entry *entry = NULL;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circular_buffer, i)
-    {
-	    if (entry->buffptr != NULL)
-	    {
-		    kfree(entry->buffptr);
-	    }
+    for (unsigned int i = 0; i < aesd_nr_devs; i++) {
+        aesd_device_cleanup(&aesd_devices[i]);
     }
-    kfree(aesd_device.current_entry.buffptr);
-    mutex_destroy(&aesd_device.device_mutex);
+    kfree(aesd_devices);
+    aesd_entry_caches_destroy();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,481 @@
+/**
+ * Closed-loop load generator for aesdsocket.
+ *
+ * Every client thread keeps exactly one request outstanding: it sends a packet carrying a tag
+ * unique to the client and request, reads the read back until the tag comes by and only then
+ * sends the next request.  The rest of a read back is drained while waiting for the next tag.
+ * A seekto request sends "AESDCHAR_IOCSEEKTO:0,0\n" pipelined with a tagged packet, so its reply
+ * ends the same way.  Latency is measured from the first byte sent to the tag received.
+ *
+ * The newline layout of a request is set by -n and -f: it carries -n tagged lines back to back,
+ * the client waits for the tag of the last one, and the bytes go out in -f sends so a send can
+ * hold several lines or end in the middle of one.  -m mixes layouts, drawing the lines and sends
+ * of every request from 1..-n and 1..-f.
+ *
+ * A packet evicted from the device history before its read back never comes back; the request
+ * times out, is counted and the client reconnects.  Keep the history above the client count.
+ *     make aesdbench
+ *     ./aesdbench [-a address] [-p port] [-c clients] [-t seconds] [-s packet_size]
+ *                 [-f fragments] [-n lines] [-m] [-k seekto_percent] [-r requests_per_connection]
+ *                 [-T timeout_ms]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 4096
+#define MAX_PACKET_SIZE (1024 * 1024)
+#define MAX_LINES 1024
+// Largest request, all lines together
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+#define MAX_TAG_SIZE 48
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define SEEKTO_COMMAND "AESDCHAR_IOCSEEKTO:0,0\n"
+
+struct options {
+    struct sockaddr_in address;
+    unsigned int clients;
+    unsigned int seconds;
+    size_t packet_size;          // including the newline
+    unsigned int fragments;      // sends each request is split into
+    unsigned int lines;          // packets per request
+    bool mixed;                  // draw lines and fragments of each request from 1..lines, 1..fragments
+    unsigned int seekto_percent;
+    unsigned int requests_per_connection;  // 0 keeps one connection for the whole run
+    unsigned int timeout_ms;
+};
+
+struct client {
+    pthread_t thread;
+    unsigned int id;
+    unsigned int seed;
+    uint64_t *latencies;         // ns, one per completed request
+    size_t count;
+    size_t capacity;
+    uint64_t seektos;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t timeouts;
+    uint64_t errors;
+    uint64_t connections;
+};
+
+static struct options options = {
+    .clients = 8,
+    .seconds = 5,
+    .packet_size = 64,
+    .fragments = 1,
+    .lines = 1,
+    .mixed = false,
+    .seekto_percent = 0,
+    .requests_per_connection = 0,
+    .timeout_ms = 2000,
+};
+static atomic_bool stop = false;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static int connect_server(struct client *client)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // Fragments must reach the server as separate segments
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(fd, (struct sockaddr *)&options.address, sizeof(options.address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    client->connections++;
+    return fd;
+}
+
+static int send_all(int fd, const char *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buffer += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+// Send @param size bytes of @param packet in @param fragments pieces.  The @param prefix_size
+// bytes in front of the packet, the seekto command if any, go out with the first piece.
+static int send_request(struct client *client, int fd, const char *packet, size_t prefix_size, size_t size,
+                        unsigned int fragments)
+{
+    const char *start = packet - prefix_size;
+    size_t begin = 0;
+    for (unsigned int i = 1; i <= fragments; i++)
+    {
+        size_t end = prefix_size + size * i / fragments;
+        if (end > begin && send_all(fd, start + begin, end - begin) != 0)
+        {
+            client->errors++;
+            return -1;
+        }
+        begin = end;
+    }
+    client->bytes_sent += prefix_size + size;
+    return 0;
+}
+
+// Read until @param tag has been received.  @return 0 when it was, -1 on error or timeout.
+static int wait_for_tag(struct client *client, int fd, const char *tag, size_t tag_size, char *window)
+{
+    uint64_t deadline = now_ns() + (uint64_t)options.timeout_ms * 1000000u;
+    size_t carried = 0;
+    while (true)
+    {
+        uint64_t now = now_ns();
+        if (now >= deadline)
+        {
+            client->timeouts++;
+            return -1;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+        if (ready < 0 && errno != EINTR)
+        {
+            client->errors++;
+            return -1;
+        }
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        ssize_t received = recv(fd, window + carried, RECV_BUFFER_SIZE, 0);
+        if (received <= 0)
+        {
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            client->errors++;
+            return -1;
+        }
+        client->bytes_received += received;
+        size_t length = carried + received;
+        if (memmem(window, length, tag, tag_size) != NULL)
+        {
+            return 0;
+        }
+        // Keep what could be the start of a tag split across two receives
+        carried = length < tag_size - 1 ? length : tag_size - 1;
+        memmove(window, window + length - carried, carried);
+    }
+}
+
+static void record_latency(struct client *client, uint64_t latency)
+{
+    if (client->count == client->capacity)
+    {
+        size_t capacity = client->capacity == 0 ? 4096 : client->capacity * 2;
+        uint64_t *latencies = realloc(client->latencies, capacity * sizeof(*latencies));
+        if (latencies == NULL)
+        {
+            return;
+        }
+        client->latencies = latencies;
+        client->capacity = capacity;
+    }
+    client->latencies[client->count++] = latency;
+}
+
+// Write @param lines tagged packets for request @param sequence to @param packet and the tag of
+// the last one to @param tag.  @return the size of all packets together.
+static size_t fill_lines(const struct client *client, uint64_t sequence, unsigned int lines, char *packet,
+                         char *tag, int *tag_size)
+{
+    size_t total = 0;
+    for (unsigned int line = 0; line < lines; line++)
+    {
+        *tag_size = snprintf(tag, MAX_TAG_SIZE, "@%u.%" PRIu64 ".%u@", client->id, sequence, line);
+        size_t size = options.packet_size > (size_t)*tag_size ? options.packet_size : (size_t)*tag_size + 1;
+        char *start = packet + total;
+        memcpy(start, tag, *tag_size);
+        for (size_t i = *tag_size; i < size - 1; i++)
+        {
+            start[i] = 'a' + i % 26;
+        }
+        start[size - 1] = '\n';
+        total += size;
+    }
+    return total;
+}
+
+static void *client_thread(void *arg)
+{
+    struct client *client = arg;
+    size_t prefix_size = sizeof(SEEKTO_COMMAND) - 1;
+    size_t line_capacity = options.packet_size > MAX_TAG_SIZE ? options.packet_size : MAX_TAG_SIZE + 1;
+    char *buffer = malloc(prefix_size + options.lines * line_capacity);
+    char *window = malloc(RECV_BUFFER_SIZE + MAX_TAG_SIZE);
+    if (buffer == NULL || window == NULL)
+    {
+        client->errors++;
+        free(buffer);
+        free(window);
+        return NULL;
+    }
+    char *packet = buffer + prefix_size;
+    memcpy(buffer, SEEKTO_COMMAND, prefix_size);
+
+    int fd = -1;
+    unsigned int requests_on_connection = 0;
+    for (uint64_t sequence = 0; !atomic_load_explicit(&stop, memory_order_relaxed); sequence++)
+    {
+        if (fd >= 0 && options.requests_per_connection != 0 &&
+            requests_on_connection == options.requests_per_connection)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0)
+        {
+            fd = connect_server(client);
+            if (fd < 0)
+            {
+                client->errors++;
+                usleep(10000);
+                continue;
+            }
+            requests_on_connection = 0;
+        }
+
+        unsigned int lines = options.lines;
+        unsigned int fragments = options.fragments;
+        if (options.mixed)
+        {
+            lines = 1 + rand_r(&client->seed) % options.lines;
+            fragments = 1 + rand_r(&client->seed) % options.fragments;
+        }
+        char tag[MAX_TAG_SIZE];
+        int tag_size = 0;
+        size_t size = fill_lines(client, sequence, lines, packet, tag, &tag_size);
+        bool seekto = (unsigned int)(rand_r(&client->seed) % 100) < options.seekto_percent;
+
+        uint64_t start = now_ns();
+        if (send_request(client, fd, packet, seekto ? prefix_size : 0, size, fragments) != 0 ||
+            wait_for_tag(client, fd, tag, tag_size, window) != 0)
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        record_latency(client, now_ns() - start);
+        client->seektos += seekto;
+        requests_on_connection++;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(buffer);
+    free(window);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double fraction)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (count - 1) + 0.5);
+    return sorted[index] / 1e3;
+}
+
+static int report(struct client *clients, double elapsed_s)
+{
+    struct client total;
+    memset(&total, 0, sizeof(total));
+    for (unsigned int i = 0; i < options.clients; i++)
+    {
+        total.count += clients[i].count;
+        total.seektos += clients[i].seektos;
+        total.bytes_sent += clients[i].bytes_sent;
+        total.bytes_received += clients[i].bytes_received;
+        total.timeouts += clients[i].timeouts;
+        total.errors += clients[i].errors;
+        total.connections += clients[i].connections;
+    }
+    uint64_t *latencies = malloc((total.count > 0 ? total.count : 1) * sizeof(*latencies));
+    if (latencies == NULL)
+    {
+        return -1;
+    }
+    size_t merged = 0;
+    for (unsigned int i = 0; i < options.clients; i++)
+    {
+        memcpy(latencies + merged, clients[i].latencies, clients[i].count * sizeof(*latencies));
+        merged += clients[i].count;
+    }
+    qsort(latencies, merged, sizeof(*latencies), compare_u64);
+
+    printf("clients %u, packet %zu bytes, %s%u lines in %s%u fragments, seekto %u%%, %u requests per connection, %.1f s\n",
+           options.clients, options.packet_size, options.mixed ? "1.." : "", options.lines,
+           options.mixed ? "1.." : "", options.fragments, options.seekto_percent,
+           options.requests_per_connection, elapsed_s);
+    printf("requests: %zu (%.1f/s), seekto %" PRIu64 ", timeouts %" PRIu64 ", errors %" PRIu64 ", connections %" PRIu64 "\n",
+           merged, merged / elapsed_s, total.seektos, total.timeouts, total.errors, total.connections);
+    printf("sent: %.2f MiB/s, received: %.2f MiB/s\n", total.bytes_sent / elapsed_s / (1024 * 1024),
+           total.bytes_received / elapsed_s / (1024 * 1024));
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", percentile_us(latencies, merged, 0.5),
+           percentile_us(latencies, merged, 0.99), percentile_us(latencies, merged, 0.999),
+           merged > 0 ? latencies[merged - 1] / 1e3 : 0);
+    free(latencies);
+    return 0;
+}
+
+static unsigned long parse_option(const char *value, unsigned long min, unsigned long max, const char *name)
+{
+    char *end;
+    unsigned long result = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || result < min || result > max)
+    {
+        fprintf(stderr, "%s must be between %lu and %lu\n", name, min, max);
+        exit(1);
+    }
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    options.address.sin_family = AF_INET;
+    options.address.sin_port = htons(9000);
+    options.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:c:t:s:f:n:mk:r:T:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                if (inet_pton(AF_INET, optarg, &options.address.sin_addr) != 1)
+                {
+                    fprintf(stderr, "Address must be an IPv4 address\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                options.address.sin_port = htons(parse_option(optarg, 1, 65535, "Port"));
+                break;
+            case 'c':
+                options.clients = parse_option(optarg, 1, MAX_CLIENTS, "Clients");
+                break;
+            case 't':
+                options.seconds = parse_option(optarg, 1, 3600, "Duration");
+                break;
+            case 's':
+                options.packet_size = parse_option(optarg, 1, MAX_PACKET_SIZE, "Packet size");
+                break;
+            case 'f':
+                options.fragments = parse_option(optarg, 1, 64, "Fragments");
+                break;
+            case 'n':
+                options.lines = parse_option(optarg, 1, MAX_LINES, "Lines");
+                break;
+            case 'm':
+                options.mixed = true;
+                break;
+            case 'k':
+                options.seekto_percent = parse_option(optarg, 0, 100, "Seekto percentage");
+                break;
+            case 'r':
+                options.requests_per_connection = parse_option(optarg, 0, UINT32_MAX, "Requests per connection");
+                break;
+            case 'T':
+                options.timeout_ms = parse_option(optarg, 1, 600000, "Timeout");
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-a address] [-p port] [-c clients] [-t seconds] [-s packet_size] "
+                        "[-f fragments] [-n lines] [-m] [-k seekto_percent] [-r requests_per_connection] "
+                        "[-T timeout_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (options.lines * options.packet_size > MAX_REQUEST_SIZE)
+    {
+        fprintf(stderr, "Lines times packet size must be at most %d\n", MAX_REQUEST_SIZE);
+        return 1;
+    }
+
+    struct client *clients = calloc(options.clients, sizeof(*clients));
+    if (clients == NULL)
+    {
+        return 1;
+    }
+    uint64_t start = now_ns();
+    unsigned int started = 0;
+    for (; started < options.clients; started++)
+    {
+        clients[started].id = started;
+        clients[started].seed = started * 2654435761u + 1;
+        if (pthread_create(&clients[started].thread, NULL, client_thread, &clients[started]) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            atomic_store(&stop, true);
+            break;
+        }
+    }
+    if (started == options.clients)
+    {
+        sleep(options.seconds);
+        atomic_store(&stop, true);
+    }
+    for (unsigned int i = 0; i < started; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double elapsed_s = (now_ns() - start) / 1e9;
+
+    int rc = started == options.clients ? report(clients, elapsed_s) : -1;
+    for (unsigned int i = 0; i < options.clients; i++)
+    {
+        free(clients[i].latencies);
+    }
+    free(clients);
+    return rc == 0 ? 0 : 1;
+}
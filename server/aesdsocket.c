@@ -1,4 +1,4 @@
-#include <syslog.h>
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stddef.h>
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <fcntl.h>
@@ -15,20 +16,40 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <pthread.h>
 
 #include "queue.h"
 #include "connection_thread.h"
+#include "worker_pool.h"
+#include "subscription.h"
+#include "connection_pool.h"
+#include "metrics.h"
+#include "log.h"
+
+#define MAX_EPOLL_EVENTS 64
+#define METRICS_BUFFER_SIZE (16 * 1024)
+
+// Connections currently owned by the server, either waiting in epoll or being handled by a worker.
+struct connection_list {
+    pthread_mutex_t mutex;
+    LIST_HEAD(connection_head, connection_thread_args) head;
+};
 
-// SLIST.
-typedef struct slist_data_s slist_data_t;
-struct slist_data_s {
-    struct connection_thread_args *connection;
-    pthread_t *thread;
-    SLIST_ENTRY(slist_data_s) entries;
+struct server_context {
+    int epoll_fd;
+    struct connection_list connections;
+    struct connection_pool pool;  // slots for at most -c connections
+    struct storage **storages;    // history of each shard
+    unsigned int num_storages;
 };
 
 const char *timestamp_tag = "timestamp:";
 static volatile sig_atomic_t quit = 0;
+// Self-pipe written by shutdown_handler so a signal always wakes the epoll wait
+static int shutdown_pipe[2] = {-1, -1};
+// Local listening socket of the -m metrics endpoint, -1 when disabled
+static int metrics_fd = -1;
 
 void stop_process(int socket_fd)
 {
@@ -43,147 +64,481 @@ static void shutdown_handler(int signal_number)
     if (signal_number == SIGINT || signal_number == SIGTERM)
     {
         quit = 1;
+        int saved_errno = errno;
+        char wakeup = 0;
+        if (write(shutdown_pipe[1], &wakeup, 1) < 0)
+        {
+            // Pipe already holds a pending wakeup
+        }
+        errno = saved_errno;
     }
 }
 
+// SIGUSR1 makes the log more verbose, SIGUSR2 quieter, one level per signal
+static void log_level_handler(int signal_number)
+{
+    log_adjust_level(signal_number == SIGUSR1 ? 1 : -1);
+}
+
 void setup_handlers()
 {
+    if (pipe2(shutdown_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to create shutdown pipe: %s", strerror(errno));
+    }
+
     struct sigaction shutdown_action;
     memset(&shutdown_action, 0, sizeof(struct sigaction));
     shutdown_action.sa_handler = shutdown_handler;
     if (sigaction(SIGINT, &shutdown_action, NULL) != 0)
     {
-        syslog(LOG_ERR, "Failed to add SIGINT to sigaction: %s", strerror(errno));
+        log_msg(LOG_ERR, "Failed to add SIGINT to sigaction: %s", strerror(errno));
     }
     if (sigaction(SIGTERM, &shutdown_action, NULL) != 0)
     {
-        syslog(LOG_ERR, "Failed to add SIGTERM to sigaction: %s", strerror(errno));
+        log_msg(LOG_ERR, "Failed to add SIGTERM to sigaction: %s", strerror(errno));
+    }
+
+    struct sigaction log_level_action;
+    memset(&log_level_action, 0, sizeof(struct sigaction));
+    log_level_action.sa_handler = log_level_handler;
+    log_level_action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &log_level_action, NULL) != 0 || sigaction(SIGUSR2, &log_level_action, NULL) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to add SIGUSR1/SIGUSR2 to sigaction: %s", strerror(errno));
     }
 }
 
-int run_server(int socket_fd)
+static void close_connection(struct server_context *server, struct connection_thread_args *connection)
 {
-    pthread_mutex_t *file_mutex = malloc(sizeof(pthread_mutex_t));
-    if (file_mutex == NULL) {
-        syslog(LOG_ERR, "Failed to setup mutex.");
-        return -1;
+    pthread_mutex_lock(&server->connections.mutex);
+    LIST_REMOVE(connection, list_entries);
+    pthread_mutex_unlock(&server->connections.mutex);
+
+    if (connection->subscribed) {
+        subscription_remove(connection);
     }
-    pthread_mutex_init(file_mutex, NULL);
+    // Closing the descriptor also removes it from the epoll set
+    close(connection->client_fd);
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(connection->client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long duration_ms = (now.tv_sec - connection->stats.accepted.tv_sec) * 1000 +
+                       (now.tv_nsec - connection->stats.accepted.tv_nsec) / 1000000;
+    log_msg(LOG_INFO, "Closed connection from %s after %llu packets, %llu bytes, %ld ms", ip_str,
+           (unsigned long long)connection->stats.packets, (unsigned long long)connection->stats.bytes_received,
+           duration_ms);
+
+    connection_pool_put(&server->pool, connection);
+    metrics_count(METRICS_CONNECTIONS_CLOSED, 1);
+}
 
-    slist_data_t *datap=NULL;
+// Worker pool callback, runs on a worker thread once the client has data ready.
+static void handle_connection(struct connection_thread_args *connection, void *context)
+{
+    struct server_context *server = (struct server_context *) context;
 
-    SLIST_HEAD(slisthead, slist_data_s) head;
-    SLIST_INIT(&head);
+    if (connection_handle(connection) != 0)
+    {
+        close_connection(server, connection);
+        return;
+    }
 
-    // Setup the socket to listen
-    int status;
-    syslog(LOG_INFO, "Setting up listener...");
-    if ((status = listen(socket_fd, 2)) != 0)
+    // Hand the connection back to epoll until the client sends more
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->client_fd, &event) != 0)
     {
-        syslog(LOG_ERR, "Listen error: %s", gai_strerror(status));
-        return -1;
+        log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+        close_connection(server, connection);
     }
-    syslog(LOG_INFO, "Socket is listening.");
+}
 
-    // Initialize the address structure for the client
-    struct sockaddr_in client_addr;
-    socklen_t client_len;
-    client_len = sizeof(client_addr);
-    
-    // Main loop
-    while (!quit)
+// Worker pool idle callback, lets the module be reloaded while the server is quiet.
+static void release_worker_devices(void *context)
+{
+    struct server_context *server = (struct server_context *) context;
+    for (unsigned int i = 0; i < server->num_storages; i++)
     {
-        struct slist_data_s *tmp;
-        SLIST_FOREACH_SAFE(datap, &head, entries, tmp) {
-            if (datap->connection->thread_complete) {
-                pthread_join(*(datap->thread), NULL);   // note the dereference
-                free(datap->thread);
-                free(datap->connection);
-                SLIST_REMOVE(&head, datap, slist_data_s, entries);
-                free(datap);
-            }
-        }
+        storage_release_thread(server->storages[i]);
+    }
+}
 
-        // Wait for a client to send a message
-        syslog(LOG_INFO, "Waiting to accept a message...");
-        int client_fd = accept(socket_fd, (struct sockaddr *)&client_addr, &client_len);
+static void accept_connections(struct server_context *server, int socket_fd, struct append_queue *append_queues)
+{
+    while (!quit)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(socket_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
         if (client_fd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue;
-            }
-            else {
-                syslog(LOG_ERR, "Accept error: %s", strerror(errno));
-                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_ratelimited(LOG_ERR, "Accept error: %s", strerror(errno));
             }
+            return;
+        }
+        // Replies are written as soon as they are complete, connection_handle() corks the
+        // socket itself when one event produces several of them
+        int nodelay = 1;
+        if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) != 0) {
+            log_ratelimited(LOG_WARNING, "TCP_NODELAY error: %s", strerror(errno));
         }
 
         // Convert the client address structure to a human readable IPv4 and log it
         char ip_str[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &(client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-        syslog(LOG_INFO, "Accepted connection from %s", ip_str);
+        log_msg(LOG_INFO, "Accepted connection from %s", ip_str);
 
-        struct connection_thread_args *tData;
-        tData = (struct connection_thread_args *)malloc(sizeof(struct connection_thread_args));
+        // Slots come cleared from the pool, nothing is allocated per connection
+        struct connection_thread_args *tData = connection_pool_get(&server->pool);
         if (tData == NULL) {
-            syslog(LOG_ERR, "connection_thread_args memory allocation failed");
-            quit = 1;
-            continue;
-        }
-
-        pthread_t *thread = malloc(sizeof(pthread_t));
-        if (thread == NULL) {
-            ERROR_LOG("pthread_t memory allocation failed");
-            quit = 1;
+            log_ratelimited(LOG_WARNING, "Connection limit of %u reached, rejecting %s", server->pool.capacity, ip_str);
+            close(client_fd);
+            metrics_count(METRICS_CONNECTIONS_REJECTED, 1);
             continue;
         }
-        
         tData->client_addr = client_addr;
         tData->client_fd = client_fd;
         tData->client_len = client_len;
-        tData->file_mutex = file_mutex;
-        tData->thread_complete = false;
-        tData->thread_complete_success = false;
-
-        int rc = pthread_create(thread, NULL, connection_thread, tData);
-        if(rc != 0) {
-            ERROR_LOG("pthread_create");
-            quit = 1;
+        tData->shard = connection_shard_for_client(&client_addr);
+        tData->append_queue = &append_queues[tData->shard];
+        tData->storage = server->storages[tData->shard];
+        clock_gettime(CLOCK_MONOTONIC, &tData->stats.accepted);
+        metrics_count(METRICS_CONNECTIONS_ACCEPTED, 1);
+
+        pthread_mutex_lock(&server->connections.mutex);
+        LIST_INSERT_HEAD(&server->connections.head, tData, list_entries);
+        pthread_mutex_unlock(&server->connections.mutex);
+
+        // One shot so only a single worker ever owns the connection at a time
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = tData;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) != 0) {
+            log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+            close_connection(server, tData);
+        }
+    }
+}
+
+// Answer every pending metrics request with a snapshot and close it.  The text is a few KiB,
+// so the blocking send completes at once.
+static void serve_metrics(void)
+{
+    static char buffer[METRICS_BUFFER_SIZE];
+    while (true)
+    {
+        int client_fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            return;
+        }
+        size_t length = metrics_format(buffer, sizeof(buffer));
+        if (send(client_fd, buffer, length, MSG_NOSIGNAL) < 0) {
+            log_ratelimited(LOG_ERR, "metrics send error: %s", strerror(errno));
+        }
+        close(client_fd);
+    }
+}
+
+// Listen on 127.0.0.1:port only, the metrics are not meant to leave the host.
+static int open_metrics_socket(unsigned int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_msg(LOG_ERR, "metrics socket error: %s", strerror(errno));
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+        log_msg(LOG_ERR, "metrics bind error: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void close_storages(struct storage **storages, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        storage_close(storages[i]);
+    }
+    free(storages);
+}
+
+int run_server(int socket_fd, size_t num_workers, const char *output_name, unsigned int num_shards,
+               uint32_t max_connections, enum storage_backend backend, size_t history_entries)
+{
+    connection_set_output(output_name, num_shards);
+    struct server_context server;
+    server.storages = malloc(num_shards * sizeof(struct storage *));
+    if (server.storages == NULL) {
+        log_msg(LOG_ERR, "storage memory allocation failed");
+        return -1;
+    }
+    for (server.num_storages = 0; server.num_storages < num_shards; server.num_storages++) {
+        unsigned int i = server.num_storages;
+        server.storages[i] = storage_open(backend, connection_output_name(i), i, history_entries);
+        if (server.storages[i] == NULL) {
+            close_storages(server.storages, i);
+            return -1;
+        }
+    }
+
+    // One committer per output device so shards do not contend with each other
+    struct append_queue *append_queues = malloc(num_shards * sizeof(struct append_queue));
+    if (append_queues == NULL) {
+        log_msg(LOG_ERR, "append queue memory allocation failed");
+        close_storages(server.storages, server.num_storages);
+        return -1;
+    }
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (append_queue_init(&append_queues[i], server.storages[i]) != 0) {
+            while (i-- > 0) {
+                append_queue_stop(&append_queues[i]);
+            }
+            free(append_queues);
+            close_storages(server.storages, server.num_storages);
+            return -1;
+        }
+    }
+
+    // From here on every failure leaves through fail, which stops the committers
+    server.epoll_fd = -1;
+    pthread_mutex_init(&server.connections.mutex, NULL);
+    LIST_INIT(&server.connections.head);
+    if (connection_pool_init(&server.pool, max_connections) != 0)
+    {
+        goto fail;
+    }
+
+    // Setup the socket to listen
+    log_msg(LOG_DEBUG, "Setting up listener...");
+    if (listen(socket_fd, SOMAXCONN) != 0)
+    {
+        log_msg(LOG_ERR, "Listen error: %s", strerror(errno));
+        goto fail;
+    }
+    log_msg(LOG_DEBUG, "Socket is listening.");
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epoll_fd < 0)
+    {
+        log_msg(LOG_ERR, "epoll_create1 error: %s", strerror(errno));
+        goto fail;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) != 0)
+    {
+        log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+        goto fail;
+    }
+    event.data.ptr = shutdown_pipe;
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, shutdown_pipe[0], &event) != 0)
+    {
+        log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+        goto fail;
+    }
+
+    event.data.ptr = &metrics_fd;
+    if (metrics_fd >= 0 && epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, metrics_fd, &event) != 0)
+    {
+        log_msg(LOG_ERR, "epoll_ctl error: %s", strerror(errno));
+        goto fail;
+    }
+
+    struct worker_pool pool;
+    if (worker_pool_init(&pool, num_workers, handle_connection, release_worker_devices, &server) != 0)
+    {
+        goto fail;
+    }
+    log_msg(LOG_INFO, "Started %zu worker threads.", num_workers);
+
+    // Main loop
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (!quit)
+    {
+        // Sleeps until a client connects, a client has data or a shutdown signal arrives
+        int num_events = epoll_wait(server.epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (num_events < 0) {
+            if (errno != EINTR) {
+                log_msg(LOG_ERR, "epoll_wait error: %s", strerror(errno));
+            }
             continue;
         }
 
-        datap = malloc(sizeof(slist_data_t));
-        datap->connection = tData;
-        datap->thread = thread;
-        SLIST_INSERT_HEAD(&head, datap, entries);
+        for (int i = 0; i < num_events; i++)
+        {
+            struct connection_thread_args *connection = events[i].data.ptr;
+            if (events[i].data.ptr == shutdown_pipe) {
+                continue;
+            }
+            else if (events[i].data.ptr == &metrics_fd) {
+                serve_metrics();
+            }
+            else if (connection == NULL) {
+                accept_connections(&server, socket_fd, append_queues);
+            }
+            else {
+                worker_pool_submit(&pool, connection);
+            }
+        }
     }
 
-    while (!SLIST_EMPTY(&head)) {
-        datap = SLIST_FIRST(&head);
-        close(datap->connection->client_fd);
-        pthread_join(*(datap->thread), NULL);
-        free(datap->thread);
-        free(datap->connection);
-        SLIST_REMOVE_HEAD(&head, entries);
-        free(datap);
+    // Unblock workers stuck in recv/send on a client before joining them
+    pthread_mutex_lock(&server.connections.mutex);
+    struct connection_thread_args *connection;
+    LIST_FOREACH(connection, &server.connections.head, list_entries) {
+        shutdown(connection->client_fd, SHUT_RDWR);
     }
+    pthread_mutex_unlock(&server.connections.mutex);
 
-    pthread_mutex_destroy(file_mutex);
-    free(file_mutex);
+    worker_pool_stop(&pool);
+    // Workers are gone, nothing can be waiting on a commit any more
+    for (unsigned int i = 0; i < num_shards; i++) {
+        append_queue_stop(&append_queues[i]);
+    }
+
+    while (!LIST_EMPTY(&server.connections.head)) {
+        close_connection(&server, LIST_FIRST(&server.connections.head));
+    }
+    subscription_stop_all();
+    connection_pool_destroy(&server.pool);
+    close_storages(server.storages, server.num_storages);
+
+    close(server.epoll_fd);
+    close(shutdown_pipe[0]);
+    close(shutdown_pipe[1]);
+    pthread_mutex_destroy(&server.connections.mutex);
+    free(append_queues);
+    metrics_destroy();
     
     return 0;
+
+fail:
+    // No connection was accepted yet, so nothing can be waiting on a commit
+    for (unsigned int i = 0; i < num_shards; i++) {
+        append_queue_stop(&append_queues[i]);
+    }
+    free(append_queues);
+    if (server.epoll_fd >= 0) {
+        close(server.epoll_fd);
+    }
+    connection_pool_destroy(&server.pool);
+    close_storages(server.storages, server.num_storages);
+    pthread_mutex_destroy(&server.connections.mutex);
+    return -1;
 }
 
 int main(int argc, char *argv[])
 {
     bool is_daemon = false;
-    // Check for the -d daemon argument
-    char *daemon_arg = NULL;
-    if (argc > 1)
+    size_t num_workers = WORKER_POOL_DEFAULT_THREADS;
+    const char *output_name = OUTPUT_DEFAULT_NAME;
+    unsigned int num_shards = 1;
+    uint32_t max_connections = CONNECTION_POOL_DEFAULT_CAPACITY;
+    unsigned int metrics_port = 0;
+    enum storage_backend backend = STORAGE_CHARDEV;
+    size_t history_entries = STORAGE_MEMORY_DEFAULT_ENTRIES;
+    // -d runs as a daemon, -w sets the number of worker threads,
+    // -o appends to another device or file than /dev/aesdchar,
+    // -s shards clients over <output>0..<output><N-1>,
+    // -c limits the number of simultaneous connections,
+    // -m serves metrics on 127.0.0.1:<port>, -l sets the log level,
+    // -b keeps the history in the char device or in memory, -e sets how many writes memory keeps
+    int opt;
+    while ((opt = getopt(argc, argv, "dw:o:s:c:m:l:b:e:")) != -1)
     {
-        daemon_arg = argv[1];
-        if (strcmp(daemon_arg, "-d") == 0)
+        switch (opt)
         {
-            is_daemon = true;
+            case 'd':
+                is_daemon = true;
+                break;
+            case 'w':
+                num_workers = strtoul(optarg, NULL, 10);
+                if (num_workers == 0 || num_workers > WORKER_POOL_MAX_THREADS)
+                {
+                    fprintf(stderr, "Worker count must be between 1 and %d\n", WORKER_POOL_MAX_THREADS);
+                    return -1;
+                }
+                break;
+            case 'o':
+                output_name = optarg;
+                if (strlen(output_name) == 0 || strlen(output_name) > OUTPUT_NAME_MAX)
+                {
+                    fprintf(stderr, "Output path must be between 1 and %d bytes\n", OUTPUT_NAME_MAX);
+                    return -1;
+                }
+                break;
+            case 's':
+                num_shards = strtoul(optarg, NULL, 10);
+                if (num_shards == 0 || num_shards > MAX_OUTPUT_SHARDS)
+                {
+                    fprintf(stderr, "Shard count must be between 1 and %d\n", MAX_OUTPUT_SHARDS);
+                    return -1;
+                }
+                break;
+            case 'c':
+                max_connections = strtoul(optarg, NULL, 10);
+                if (max_connections == 0 || max_connections > CONNECTION_POOL_MAX_CAPACITY)
+                {
+                    fprintf(stderr, "Connection limit must be between 1 and %d\n", CONNECTION_POOL_MAX_CAPACITY);
+                    return -1;
+                }
+                break;
+            case 'm':
+                metrics_port = strtoul(optarg, NULL, 10);
+                if (metrics_port == 0 || metrics_port > 65535)
+                {
+                    fprintf(stderr, "Metrics port must be between 1 and 65535\n");
+                    return -1;
+                }
+                break;
+            case 'l':
+            {
+                int level = log_parse_level(optarg);
+                if (level < 0)
+                {
+                    fprintf(stderr, "Log level must be one of err, warning, notice, info, debug\n");
+                    return -1;
+                }
+                log_set_level(level);
+                break;
+            }
+            case 'b':
+            {
+                int parsed = storage_parse_backend(optarg);
+                if (parsed < 0)
+                {
+                    fprintf(stderr, "Storage backend must be chardev or memory\n");
+                    return -1;
+                }
+                backend = parsed;
+                break;
+            }
+            case 'e':
+                history_entries = strtoul(optarg, NULL, 10);
+                if (history_entries == 0 || history_entries > STORAGE_MEMORY_MAX_ENTRIES)
+                {
+                    fprintf(stderr, "History entries must be between 1 and %d\n", STORAGE_MEMORY_MAX_ENTRIES);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-w workers] [-o output] [-s shards] [-c max_connections] [-m metrics_port] [-l level] [-b chardev|memory] [-e entries]\n", argv[0]);
+                return -1;
         }
     }
 
@@ -196,20 +551,21 @@ int main(int argc, char *argv[])
     int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (socket_fd < 0)
     {
-        syslog(LOG_ERR, "socket error: %s", strerror(errno));
+        log_msg(LOG_ERR, "socket error: %s", strerror(errno));
         
         stop_process(socket_fd);
         return -1;
     }
-    syslog(LOG_INFO, "socket_fd: %d", socket_fd);
+    log_msg(LOG_DEBUG, "socket_fd: %d", socket_fd);
 
     // Add the ability to resuse a address that might be in use
     int optval = 1;
     if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
-        syslog(LOG_ERR, "setsockopt error: %s", strerror(errno));
+        log_msg(LOG_ERR, "setsockopt error: %s", strerror(errno));
         stop_process(socket_fd);
     }
 
+    // Non-blocking so accept_connections() can drain the backlog after a single epoll wakeup
     int flags = fcntl(socket_fd, F_GETFL, 0);
     fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
 
@@ -221,28 +577,34 @@ int main(int argc, char *argv[])
     hints.ai_socktype = SOCK_STREAM;
 
     int status = 0;
-    syslog(LOG_INFO, "Setting up address info...");
+    log_msg(LOG_DEBUG, "Setting up address info...");
     if ((status = getaddrinfo(NULL, "9000", &hints, &res)) != 0)
     {
-        syslog(LOG_ERR, "getaddrinfo error: %s", gai_strerror(status));
+        log_msg(LOG_ERR, "getaddrinfo error: %s", gai_strerror(status));
         stop_process(socket_fd);
         return -1;
     }
-    syslog(LOG_INFO, "Address info setup.");
+    log_msg(LOG_DEBUG, "Address info setup.");
 
     // Bind the server socket to the internet address
-    syslog(LOG_INFO, "Binding socket...");
+    log_msg(LOG_DEBUG, "Binding socket...");
     if ((status = bind(socket_fd, res->ai_addr, res->ai_addrlen)) != 0)
     {
-        syslog(LOG_ERR, "bind error: %s", strerror(errno));
+        log_msg(LOG_ERR, "bind error: %s", strerror(errno));
         stop_process(socket_fd);
         return -1;
     }
-    syslog(LOG_INFO, "Socket bound.");
+    log_msg(LOG_DEBUG, "Socket bound.");
 
     // Freeup the memory for the address
     freeaddrinfo(res);
 
+    if (metrics_port != 0 && (metrics_fd = open_metrics_socket(metrics_port)) < 0)
+    {
+        stop_process(socket_fd);
+        return -1;
+    }
+
     int ret = 0;
     if (is_daemon)
     {
@@ -250,20 +612,26 @@ int main(int argc, char *argv[])
         pid_t pid = fork();
         if (pid < 0)
         {
-            syslog(LOG_ERR, "fork error: %s\n", strerror(errno));
+            log_msg(LOG_ERR, "fork error: %s\n", strerror(errno));
             return false;
         }
         else if (pid == 0)
         {
-            ret = run_server(socket_fd);
+            ret = run_server(socket_fd, num_workers, output_name, num_shards, max_connections,
+                             backend, history_entries);
         }
     }
     else
     {
-        ret = run_server(socket_fd);
+        ret = run_server(socket_fd, num_workers, output_name, num_shards, max_connections,
+                             backend, history_entries);
     }
 
     stop_process(socket_fd);
+    if (metrics_fd >= 0)
+    {
+        close(metrics_fd);
+    }
 
     return ret;
 }
\ No newline at end of file
@@ -0,0 +1,178 @@
+#include "append_queue.h"
+#include "metrics.h"
+#include "log.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+// Append a batch in submission order, APPEND_QUEUE_MAX_BATCH packets at a time.  Every chunk
+// is tried on its own, and only the packets that did not make it are reported as failed.
+static void commit_batch(struct append_queue *queue, struct append_request *batch)
+{
+    queue->storage_active = true;
+    struct iovec iov[APPEND_QUEUE_MAX_BATCH];
+    struct append_request *first = batch;
+    while (first != NULL)
+    {
+        int count = 0;
+        struct append_request *request = first;
+        for (; request != NULL && count < APPEND_QUEUE_MAX_BATCH; request = request->next)
+        {
+            iov[count].iov_base = (void *)request->data;
+            iov[count].iov_len = request->size;
+            count++;
+        }
+        int error = 0;
+        int appended = storage_append(queue->storage, iov, count);
+        if (appended < count)
+        {
+            error = errno;
+            log_ratelimited(LOG_ERR, "%s append error after %d of %d packets: %s", queue->storage->name,
+                            appended, count, strerror(error));
+        }
+        for (int i = 0; first != request; first = first->next, i++)
+        {
+            first->error = i < appended ? 0 : error;
+        }
+        metrics_count(METRICS_COMMIT_BATCHES, 1);
+        metrics_count(METRICS_COMMIT_PACKETS, count);
+    }
+}
+
+static void *append_queue_thread(void *thread_param)
+{
+    struct append_queue *queue = (struct append_queue *) thread_param;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (true)
+    {
+        struct append_request *newest = atomic_exchange_explicit(&queue->pending, NULL, memory_order_acquire);
+        if (newest == NULL)
+        {
+            if (queue->stopping)
+            {
+                break;
+            }
+            // Release the storage after an idle period so the driver can be reloaded
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += APPEND_QUEUE_IDLE_TIMEOUT_MS / 1000;
+            deadline.tv_nsec += (APPEND_QUEUE_IDLE_TIMEOUT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!queue->stopping && atomic_load_explicit(&queue->pending, memory_order_relaxed) == NULL)
+            {
+                int rc = !queue->storage_active ? pthread_cond_wait(&queue->work_cond, &queue->mutex) :
+                         pthread_cond_timedwait(&queue->work_cond, &queue->mutex, &deadline);
+                if (rc == ETIMEDOUT && queue->storage_active)
+                {
+                    storage_append_release(queue->storage);
+                    queue->storage_active = false;
+                }
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+
+        // The stack holds the newest packet first, reverse it into submission order
+        struct append_request *batch = NULL;
+        while (newest != NULL)
+        {
+            struct append_request *next = newest->next;
+            newest->next = batch;
+            batch = newest;
+            newest = next;
+        }
+        commit_batch(queue, batch);
+
+        pthread_mutex_lock(&queue->mutex);
+        for (struct append_request *request = batch; request != NULL; )
+        {
+            // The submitter may return as soon as done is set, read next first
+            struct append_request *next = request->next;
+            request->done = true;
+            request = next;
+        }
+        pthread_cond_broadcast(&queue->done_cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (queue->storage_active)
+    {
+        storage_append_release(queue->storage);
+        queue->storage_active = false;
+    }
+    return thread_param;
+}
+
+int append_queue_init(struct append_queue *queue, struct storage *storage)
+{
+    memset(queue, 0, sizeof(struct append_queue));
+    queue->storage = storage;
+    atomic_init(&queue->pending, NULL);
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->work_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_cond_init(&queue->done_cond, NULL);
+
+    int rc = pthread_create(&queue->thread, NULL, append_queue_thread, queue);
+    if (rc != 0)
+    {
+        log_msg(LOG_ERR, "pthread_create error: %s", strerror(rc));
+        pthread_cond_destroy(&queue->done_cond);
+        pthread_cond_destroy(&queue->work_cond);
+        pthread_mutex_destroy(&queue->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+int append_queue_submit(struct append_queue *queue, const char *data, size_t size)
+{
+    struct append_request request = { .data = data, .size = size, .error = 0, .done = false };
+
+    request.next = atomic_load_explicit(&queue->pending, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&queue->pending, &request.next, &request,
+                                                  memory_order_release, memory_order_relaxed))
+    {
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    // Only the push onto an empty stack has to wake the committer, later ones join its batch
+    if (request.next == NULL)
+    {
+        pthread_cond_signal(&queue->work_cond);
+    }
+    while (!request.done)
+    {
+        pthread_cond_wait(&queue->done_cond, &queue->mutex);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (request.error != 0)
+    {
+        errno = request.error;
+        return -1;
+    }
+    return 0;
+}
+
+void append_queue_stop(struct append_queue *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->stopping = true;
+    pthread_cond_signal(&queue->work_cond);
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_join(queue->thread, NULL);
+
+    pthread_cond_destroy(&queue->done_cond);
+    pthread_cond_destroy(&queue->work_cond);
+    pthread_mutex_destroy(&queue->mutex);
+}
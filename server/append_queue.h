@@ -0,0 +1,62 @@
+#ifndef APPEND_QUEUE_H
+#define APPEND_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "storage.h"
+
+// Most packets handed to one storage_append()
+#define APPEND_QUEUE_MAX_BATCH 1024
+// How long the committer keeps the storage open without appends
+#define APPEND_QUEUE_IDLE_TIMEOUT_MS 1000
+
+/**
+ * A packet waiting to be appended, owned by the submitting worker
+ */
+struct append_request {
+    const char *data;
+    size_t size;
+    int error;                    // 0 once appended, otherwise the errno of the failed write
+    bool done;                    // set by the committer under the queue mutex
+    struct append_request *next;
+};
+
+/**
+ * Group commit of appends to one output storage.  Workers push packets onto a lock-free stack;
+ * a single committer thread takes everything pushed so far, restores submission order and
+ * appends the whole batch with one storage_append(), a single writev() on a device, then wakes
+ * the workers waiting on it.  The storage only ever has one writer.
+ */
+struct append_queue {
+    struct storage *storage;
+    _Atomic(struct append_request *) pending;  // newest first
+    pthread_mutex_t mutex;        // protects stopping and the done flags, pairs with the conditions
+    pthread_cond_t work_cond;     // signalled when pending becomes non-empty
+    pthread_cond_t done_cond;     // broadcast after every batch
+    bool stopping;
+    pthread_t thread;
+    bool storage_active;          // appended to since the storage was last released
+};
+
+/**
+ * Start the committer for @param storage.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int append_queue_init(struct append_queue *queue, struct storage *storage);
+
+/**
+ * Append @param size bytes at @param data, which must end in a newline so the packet forms
+ * its own entry, and wait until the batch holding it has been written.
+ * @return 0 once the packet is in the storage, -1 with errno set if the write failed.
+ */
+int append_queue_submit(struct append_queue *queue, const char *data, size_t size);
+
+/**
+ * Commit what is still queued, then stop the committer.  No submissions may be in progress.
+ */
+void append_queue_stop(struct append_queue *queue);
+
+#endif
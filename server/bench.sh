@@ -0,0 +1,31 @@
+#!/bin/sh
+# Start aesdsocket on port 9000 and drive it with aesdbench for a throughput and latency report.
+# Usage: ./bench.sh [aesdbench options]
+# AESDSOCKET_ARGS passes extra server options, e.g. AESDSOCKET_ARGS="-w 8 -s 4".
+# Appends go to /dev/aesdchar when the module is loaded.  Otherwise the server keeps the history
+# in memory with the same circular buffer the driver uses, so results stay comparable.
+
+cd `dirname $0`
+make -s aesdsocket aesdbench || exit 1
+
+storage_args=
+if [ ! -c /dev/aesdchar ]; then
+    storage_args="-b memory"
+    echo "$0: no /dev/aesdchar, keeping the history in memory"
+fi
+
+./aesdsocket $storage_args $AESDSOCKET_ARGS &
+server_pid=$!
+# Give the server time to bind
+sleep 1
+if ! kill -0 $server_pid 2>/dev/null; then
+    echo "$0: aesdsocket did not start"
+    exit 1
+fi
+
+./aesdbench "$@"
+rc=$?
+
+kill -TERM $server_pid
+wait $server_pid
+exit $rc
@@ -0,0 +1,118 @@
+#include "command.h"
+#include <string.h>
+
+// Arguments a verb takes after its ':'
+enum command_arguments {
+    ARGUMENTS_NONE,
+    ARGUMENTS_SEEKTO,     // <u32>,<u32>
+    ARGUMENTS_READFROM,   // <u64>[,<u64>]
+};
+
+struct command_verb {
+    const char *name;       // verb after COMMAND_PREFIX, including ':' when it takes arguments
+    size_t length;
+    enum command_type type;
+    enum command_arguments arguments;
+};
+
+#define COMMAND_VERB(name, type, arguments) { name, sizeof(name) - 1, type, arguments }
+
+static const struct command_verb command_verbs[] = {
+    COMMAND_VERB("IOCSEEKTO:", COMMAND_SEEKTO, ARGUMENTS_SEEKTO),
+    COMMAND_VERB("READFROM:", COMMAND_READFROM, ARGUMENTS_READFROM),
+    COMMAND_VERB("SUBSCRIBE", COMMAND_SUBSCRIBE, ARGUMENTS_NONE),
+};
+
+// Parse a decimal number starting at *cursor and no larger than max, leaving *cursor on the
+// first byte after it.  At least one digit is required.
+static bool parse_number(const char **cursor, const char *end, uint64_t max, uint64_t *value)
+{
+    const char *digit = *cursor;
+    uint64_t result = 0;
+    while (digit < end && *digit >= '0' && *digit <= '9')
+    {
+        uint64_t next = (uint64_t)(*digit - '0');
+        if (result > (max - next) / 10)
+        {
+            return false;
+        }
+        result = result * 10 + next;
+        digit++;
+    }
+    if (digit == *cursor)
+    {
+        return false;
+    }
+    *value = result;
+    *cursor = digit;
+    return true;
+}
+
+static bool parse_arguments(struct command *command, enum command_arguments arguments, const char *cursor, const char *end)
+{
+    uint64_t first = 0;
+    uint64_t second = 0;
+    switch (arguments)
+    {
+        case ARGUMENTS_NONE:
+            return cursor == end;
+        case ARGUMENTS_SEEKTO:
+            if (!parse_number(&cursor, end, UINT32_MAX, &first) || cursor == end || *cursor++ != ',' ||
+                !parse_number(&cursor, end, UINT32_MAX, &second) || cursor != end)
+            {
+                return false;
+            }
+            command->seekto.write_cmd = first;
+            command->seekto.write_cmd_offset = second;
+            return true;
+        case ARGUMENTS_READFROM:
+            if (!parse_number(&cursor, end, UINT64_MAX, &first))
+            {
+                return false;
+            }
+            command->readfrom.offset = first;
+            command->readfrom.epoch = 0;
+            command->readfrom.has_epoch = cursor != end;
+            if (cursor == end)
+            {
+                return true;
+            }
+            if (*cursor++ != ',' || !parse_number(&cursor, end, UINT64_MAX, &second) || cursor != end)
+            {
+                return false;
+            }
+            command->readfrom.epoch = second;
+            return true;
+    }
+    return false;
+}
+
+enum command_type command_parse(struct command *command, const char *packet, size_t packet_size)
+{
+    static const size_t prefix_length = sizeof(COMMAND_PREFIX) - 1;
+
+    command->type = COMMAND_NONE;
+    // Data packets almost never share the prefix, so most are rejected by this compare
+    if (packet_size <= prefix_length || packet[packet_size - 1] != '\n' ||
+        memcmp(packet, COMMAND_PREFIX, prefix_length) != 0)
+    {
+        return COMMAND_NONE;
+    }
+
+    const char *verb = packet + prefix_length;
+    const char *end = packet + packet_size - 1;  // the newline
+    for (size_t i = 0; i < sizeof(command_verbs) / sizeof(command_verbs[0]); i++)
+    {
+        const struct command_verb *candidate = &command_verbs[i];
+        if ((size_t)(end - verb) < candidate->length || memcmp(verb, candidate->name, candidate->length) != 0)
+        {
+            continue;
+        }
+        if (parse_arguments(command, candidate->arguments, verb + candidate->length, end))
+        {
+            command->type = candidate->type;
+        }
+        return command->type;
+    }
+    return COMMAND_NONE;
+}
@@ -0,0 +1,52 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every command starts with this prefix, packets without it are data
+#define COMMAND_PREFIX "AESDCHAR_"
+
+/**
+ * Packets the server interprets instead of appending to the device:
+ * "AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>\n" moves the read back position.
+ * "AESDCHAR_READFROM:<offset>[,<epoch>]\n" asks for the history from a stream offset.
+ * "AESDCHAR_SUBSCRIBE\n" turns the connection into a subscriber.
+ */
+enum command_type {
+    COMMAND_NONE,
+    COMMAND_SEEKTO,
+    COMMAND_READFROM,
+    COMMAND_SUBSCRIBE,
+};
+
+/**
+ * An incremental read back request.  Offsets count every byte ever written to the device, so
+ * they stay valid while older entries are evicted.
+ */
+struct readfrom_request {
+    uint64_t offset;           // first stream offset the client does not have yet
+    uint64_t epoch;            // epoch of the history the offset was taken from
+    bool has_epoch;
+};
+
+struct command {
+    enum command_type type;
+    union {
+        struct aesd_seekto seekto;
+        struct readfrom_request readfrom;
+    };
+};
+
+/**
+ * Recognize a command in one complete packet of @param packet_size bytes, including its
+ * newline.  The packet does not need to be NUL terminated and is scanned at most once without
+ * allocating.  A packet must match a verb and its arguments exactly, numbers are plain decimal
+ * and must fit their field; anything else is data.
+ * @return the type stored in @param command, COMMAND_NONE for data.
+ */
+enum command_type command_parse(struct command *command, const char *packet, size_t packet_size);
+
+#endif
@@ -0,0 +1,265 @@
+/**
+ * Fuzz and throughput harness for command_parse().
+ *
+ * Mutates valid commands and random lines and compares every result against a straightforward
+ * reference parser, then measures the cost of classifying typical packets.  Each input lives in
+ * an exactly sized heap buffer, so building with -fsanitize=address also catches reads past the
+ * end of a packet:
+ *     make command_fuzz CFLAGS="-Wall -Werror -O1 -g -fsanitize=address"
+ *     ./command_fuzz [iterations] [seed]
+ */
+#include "command.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PACKET_SIZE 96
+
+static const char *seeds[] = {
+    "AESDCHAR_IOCSEEKTO:0,0\n",
+    "AESDCHAR_IOCSEEKTO:4294967295,4294967295\n",
+    "AESDCHAR_IOCSEEKTO:4294967296,1\n",
+    "AESDCHAR_READFROM:0\n",
+    "AESDCHAR_READFROM:18446744073709551615,18446744073709551615\n",
+    "AESDCHAR_READFROM:18446744073709551616\n",
+    "AESDCHAR_READFROM:12,3\n",
+    "AESDCHAR_SUBSCRIBE\n",
+    "hello world\n",
+    "time: 10, place: here\n",
+};
+
+// Parse a decimal field into a NUL terminated copy with strtoull.
+static int reference_number(const char *start, size_t length, uint64_t max, uint64_t *value)
+{
+    char digits[32];
+    if (length == 0 || length >= sizeof(digits))
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        if (start[i] < '0' || start[i] > '9')
+        {
+            return -1;
+        }
+    }
+    memcpy(digits, start, length);
+    digits[length] = '\0';
+    errno = 0;
+    unsigned long long result = strtoull(digits, NULL, 10);
+    if (errno == ERANGE || result > max)
+    {
+        return -1;
+    }
+    *value = result;
+    return 0;
+}
+
+// Split "<a>[,<b>]" into its fields.
+static int reference_pair(const char *args, size_t length, bool second_required, uint64_t max,
+                          uint64_t *first, uint64_t *second, bool *has_second)
+{
+    const char *comma = memchr(args, ',', length);
+    *has_second = comma != NULL;
+    if (comma == NULL)
+    {
+        return second_required ? -1 : reference_number(args, length, max, first);
+    }
+    if (reference_number(args, comma - args, max, first) != 0)
+    {
+        return -1;
+    }
+    return reference_number(comma + 1, length - (comma - args) - 1, max, second);
+}
+
+static enum command_type reference_parse(struct command *command, const char *packet, size_t size)
+{
+    command->type = COMMAND_NONE;
+    if (size < 1 || packet[size - 1] != '\n')
+    {
+        return COMMAND_NONE;
+    }
+    size_t length = size - 1;
+    uint64_t first = 0;
+    uint64_t second = 0;
+    bool has_second = false;
+    if (length >= 19 && memcmp(packet, "AESDCHAR_IOCSEEKTO:", 19) == 0)
+    {
+        if (reference_pair(packet + 19, length - 19, true, UINT32_MAX, &first, &second, &has_second) == 0)
+        {
+            command->type = COMMAND_SEEKTO;
+            command->seekto.write_cmd = first;
+            command->seekto.write_cmd_offset = second;
+        }
+    }
+    else if (length >= 18 && memcmp(packet, "AESDCHAR_READFROM:", 18) == 0)
+    {
+        if (reference_pair(packet + 18, length - 18, false, UINT64_MAX, &first, &second, &has_second) == 0)
+        {
+            command->type = COMMAND_READFROM;
+            command->readfrom.offset = first;
+            command->readfrom.epoch = has_second ? second : 0;
+            command->readfrom.has_epoch = has_second;
+        }
+    }
+    else if (length == 18 && memcmp(packet, "AESDCHAR_SUBSCRIBE", 18) == 0)
+    {
+        command->type = COMMAND_SUBSCRIBE;
+    }
+    return command->type;
+}
+
+static bool same_command(const struct command *a, const struct command *b)
+{
+    if (a->type != b->type)
+    {
+        return false;
+    }
+    switch (a->type)
+    {
+        case COMMAND_SEEKTO:
+            return a->seekto.write_cmd == b->seekto.write_cmd &&
+                   a->seekto.write_cmd_offset == b->seekto.write_cmd_offset;
+        case COMMAND_READFROM:
+            return a->readfrom.offset == b->readfrom.offset &&
+                   a->readfrom.epoch == b->readfrom.epoch &&
+                   a->readfrom.has_epoch == b->readfrom.has_epoch;
+        default:
+            return true;
+    }
+}
+
+// Apply a few random edits biased towards the characters the grammar cares about.
+static size_t mutate(char *packet, size_t size)
+{
+    static const char interesting[] = "0123456789,:\n9A_";
+    int edits = 1 + rand() % 3;
+    for (int i = 0; i < edits; i++)
+    {
+        size_t position = size > 0 ? (size_t)rand() % size : 0;
+        char byte = rand() % 4 == 0 ? (char)(rand() % 256) : interesting[rand() % (sizeof(interesting) - 1)];
+        switch (rand() % 4)
+        {
+            case 0:
+                if (size > 0)
+                {
+                    packet[position] = byte;
+                }
+                break;
+            case 1:
+                if (size < MAX_PACKET_SIZE)
+                {
+                    memmove(packet + position + 1, packet + position, size - position);
+                    packet[position] = byte;
+                    size++;
+                }
+                break;
+            case 2:
+                if (size > 0)
+                {
+                    memmove(packet + position, packet + position + 1, size - position - 1);
+                    size--;
+                }
+                break;
+            default:
+                size = position;
+                break;
+        }
+    }
+    return size;
+}
+
+static int fuzz(unsigned long iterations)
+{
+    unsigned long commands = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        char scratch[MAX_PACKET_SIZE + 1];
+        const char *seed = seeds[rand() % (sizeof(seeds) / sizeof(seeds[0]))];
+        size_t size = strlen(seed);
+        memcpy(scratch, seed, size);
+        if (i % 4 != 0)
+        {
+            size = mutate(scratch, size);
+        }
+
+        char *packet = malloc(size > 0 ? size : 1);
+        if (packet == NULL)
+        {
+            return -1;
+        }
+        memcpy(packet, scratch, size);
+        struct command actual;
+        struct command expected;
+        command_parse(&actual, packet, size);
+        reference_parse(&expected, packet, size);
+        if (!same_command(&actual, &expected))
+        {
+            fprintf(stderr, "mismatch on \"%.*s\": parser %d, reference %d\n", (int)size, packet,
+                    actual.type, expected.type);
+            free(packet);
+            return -1;
+        }
+        commands += actual.type != COMMAND_NONE;
+        free(packet);
+    }
+    printf("fuzz: %lu inputs, %lu recognized as commands, no mismatches\n", iterations, commands);
+    return 0;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void throughput(unsigned long iterations)
+{
+    static const char *packets[] = {
+        "The quick brown fox jumps over the lazy dog\n",
+        "timestamp:Mon, 01 Jan 2024 00:00:00 +0000\n",
+        "AESDCHAR_IOCSEEKTO:3,14\n",
+        "AESDCHAR_READFROM:1048576,42\n",
+    };
+    size_t count = sizeof(packets) / sizeof(packets[0]);
+    size_t sizes[sizeof(packets) / sizeof(packets[0])];
+    for (size_t i = 0; i < count; i++)
+    {
+        sizes[i] = strlen(packets[i]);
+    }
+
+    unsigned long recognized = 0;
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        struct command command;
+        recognized += command_parse(&command, packets[i % count], sizes[i % count]) != COMMAND_NONE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("throughput: %lu packets in %.1f ms, %.1f ns per packet (%lu commands)\n", iterations,
+           elapsed_ns(&start, &end) / 1e6, elapsed_ns(&start, &end) / iterations, recognized);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 10) : (unsigned int)time(NULL);
+    if (iterations == 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations] [seed]\n", argv[0]);
+        return 1;
+    }
+    printf("seed: %u\n", seed);
+    srand(seed);
+
+    if (fuzz(iterations) != 0)
+    {
+        return 1;
+    }
+    throughput(iterations * 10);
+    return 0;
+}
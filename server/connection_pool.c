@@ -0,0 +1,98 @@
+#include "connection_pool.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Index terminating the free stack
+#define FREE_LIST_END UINT32_MAX
+
+#define FREE_HEAD(tag, index) (((uint64_t)(tag) << 32) | (index))
+#define FREE_HEAD_TAG(head) ((uint32_t)((head) >> 32))
+#define FREE_HEAD_INDEX(head) ((uint32_t)(head))
+
+int connection_pool_init(struct connection_pool *pool, uint32_t capacity)
+{
+    memset(pool, 0, sizeof(struct connection_pool));
+    pool->slots = aligned_alloc(CACHE_LINE_SIZE, capacity * sizeof(struct connection_slot));
+    pool->next_free = malloc(capacity * sizeof(pool->next_free[0]));
+    if (pool->slots == NULL || pool->next_free == NULL)
+    {
+        log_msg(LOG_ERR, "connection pool memory allocation failed");
+        free(pool->slots);
+        free(pool->next_free);
+        // Leave the pool safe to destroy
+        memset(pool, 0, sizeof(struct connection_pool));
+        return -1;
+    }
+    memset(pool->slots, 0, capacity * sizeof(struct connection_slot));
+    pool->capacity = capacity;
+
+    // Stack the slots so the lowest index is handed out first
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        packet_buffer_init(&pool->slots[i].connection.packets);
+        atomic_init(&pool->next_free[i], i + 1 < capacity ? i + 1 : FREE_LIST_END);
+    }
+    atomic_init(&pool->free_head, FREE_HEAD(0, capacity > 0 ? 0 : FREE_LIST_END));
+    atomic_init(&pool->in_use, 0);
+    return 0;
+}
+
+struct connection_thread_args *connection_pool_get(struct connection_pool *pool)
+{
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+    uint32_t index;
+    while (true)
+    {
+        index = FREE_HEAD_INDEX(head);
+        if (index == FREE_LIST_END)
+        {
+            return NULL;
+        }
+        uint32_t next = atomic_load_explicit(&pool->next_free[index], memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, next);
+        if (atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head,
+                                                  memory_order_acquire, memory_order_acquire))
+        {
+            break;
+        }
+    }
+    atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed);
+
+    // Keep the packet buffer so a reused slot does not allocate on its first receive
+    struct connection_thread_args *connection = &pool->slots[index].connection;
+    struct packet_buffer packets = connection->packets;
+    memset(connection, 0, sizeof(struct connection_thread_args));
+    connection->packets = packets;
+    return connection;
+}
+
+void connection_pool_put(struct connection_pool *pool, struct connection_thread_args *connection)
+{
+    uint32_t index = (struct connection_slot *)connection - pool->slots;
+    packet_buffer_reset(&connection->packets);
+
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    while (true)
+    {
+        atomic_store_explicit(&pool->next_free[index], FREE_HEAD_INDEX(head), memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, index);
+        if (atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head,
+                                                  memory_order_release, memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+}
+
+void connection_pool_destroy(struct connection_pool *pool)
+{
+    for (uint32_t i = 0; i < pool->capacity; i++)
+    {
+        packet_buffer_free(&pool->slots[i].connection.packets);
+    }
+    free(pool->slots);
+    free(pool->next_free);
+    memset(pool, 0, sizeof(struct connection_pool));
+}
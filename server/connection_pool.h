@@ -0,0 +1,56 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "connection_thread.h"
+
+#define CONNECTION_POOL_DEFAULT_CAPACITY 1024
+#define CONNECTION_POOL_MAX_CAPACITY (1024 * 1024)
+#define CACHE_LINE_SIZE 64
+
+/**
+ * One connection per cache line aligned slot, so workers handling neighbouring connections
+ * do not share cache lines.
+ */
+struct connection_slot {
+    struct connection_thread_args connection;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * A fixed number of connection slots allocated up front.  Free slots form a lock-free stack:
+ * the accept loop takes slots while workers return them concurrently.  The head packs a slot
+ * index with a tag that changes on every update, so a stale head can never be swapped back in.
+ */
+struct connection_pool {
+    struct connection_slot *slots;
+    _Atomic uint32_t *next_free;  // next_free[i] is the slot below i on the free stack
+    uint32_t capacity;
+    _Atomic uint64_t free_head;   // tag in the upper 32 bits, index of the top free slot in the lower
+    _Atomic uint32_t in_use;
+};
+
+/**
+ * Allocate @param capacity slots, all free.
+ * @return 0 on success, -1 if the memory could not be allocated.
+ */
+int connection_pool_init(struct connection_pool *pool, uint32_t capacity);
+
+/**
+ * Take a free slot, cleared except for its packet buffer storage.
+ * @return NULL once all slots are in use.
+ */
+struct connection_thread_args *connection_pool_get(struct connection_pool *pool);
+
+/**
+ * Give @param connection back to the pool.  Its socket must already be closed.
+ */
+void connection_pool_put(struct connection_pool *pool, struct connection_thread_args *connection);
+
+/**
+ * Release the pool's memory, including packet buffers kept by free slots.
+ */
+void connection_pool_destroy(struct connection_pool *pool);
+
+#endif
@@ -1,204 +1,410 @@
 #include "connection_thread.h"
+#include "subscription.h"
+#include "metrics.h"
+#include "log.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <syslog.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 
 #define BUFFER_SIZE 1024
+#define MAX_RECV_PER_EVENT 16
+#define SEND_BUFFER_SIZE (64 * 1024)
+#define SENDFILE_CHUNK_SIZE (1024 * 1024)
 
-const char *outputfile_name = "/dev/aesdchar";
+const char *outputfile_name = OUTPUT_DEFAULT_NAME;
+static unsigned int output_shards = 1;
+static char output_shard_names[MAX_OUTPUT_SHARDS][OUTPUT_NAME_MAX + 4];
 
-void lock_mutex(pthread_mutex_t *file_mutex)
+void connection_set_output(const char *name, unsigned int num_shards)
 {
-    int rc = pthread_mutex_lock(file_mutex);
-    if(rc != 0) 
+    outputfile_name = name;
+    output_shards = num_shards;
+    for (unsigned int i = 0; i < num_shards && num_shards > 1; i++)
     {
-        ERROR_LOG("pthread_mutex_lock");
+        snprintf(output_shard_names[i], sizeof(output_shard_names[i]), "%s%u", outputfile_name, i);
     }
 }
 
-void unlock_mutex(pthread_mutex_t *file_mutex)
+unsigned int connection_shard_for_client(const struct sockaddr_in *client_addr)
 {
-    int rc = pthread_mutex_unlock(file_mutex);
-    if(rc != 0) {
-        ERROR_LOG("pthread_mutex_unlock");
+    if (output_shards <= 1)
+    {
+        return 0;
+    }
+    // FNV-1a over the IPv4 address
+    uint32_t hash = 2166136261u;
+    const unsigned char *key = (const unsigned char *)&client_addr->sin_addr.s_addr;
+    for (size_t i = 0; i < sizeof(client_addr->sin_addr.s_addr); i++)
+    {
+        hash = (hash ^ key[i]) * 16777619u;
     }
+    return hash % output_shards;
 }
 
-int recv_messages(char *recv_buffer, int client_fd, int output_fd)
+const char *connection_output_name(unsigned int shard)
 {
-    ssize_t received_size = 0;
-    bool mutex_set = false;
+    return output_shards > 1 ? output_shard_names[shard] : outputfile_name;
+}
 
-    do
+// Drain what the client has sent so far into its packet buffer without blocking.
+// Returns 1 once the client has closed its side, 0 when no more data is ready and -1 on error.
+static int recv_available(struct connection_thread_args *connection_data)
+{
+    // Bounded so one fast sender cannot monopolize a worker, epoll re-reports the rest.
+    // Receiving also pauses once PACKET_MAX_SIZE bytes wait, so the packets among them are
+    // handled before the buffer grows further.
+    for (int i = 0; i < MAX_RECV_PER_EVENT &&
+                    packet_buffer_pending(&connection_data->packets) < PACKET_MAX_SIZE; i++)
     {
-        syslog(LOG_INFO, "Receiving from client...");
-        memset(recv_buffer, 0, BUFFER_SIZE);
-        received_size = recv(client_fd, recv_buffer, BUFFER_SIZE, 0);
-        if (!mutex_set)
+        size_t available = 0;
+        char *buffer = packet_buffer_reserve(&connection_data->packets, BUFFER_SIZE, &available);
+        if (buffer == NULL)
         {
-            mutex_set = true;
+            log_msg(LOG_ERR, "packet memory allocation failed");
+            return -1;
         }
+
+        ssize_t received_size = recv(connection_data->client_fd, buffer, available, 0);
         if (received_size == 0)
         {
-            syslog(LOG_ERR, "The client has closed");
-            return -1;
+            log_msg(LOG_DEBUG, "The client has closed");
+            return 1;
         }
         if (received_size < 0)
         {
-            syslog(LOG_ERR, "recv error: %s", strerror(errno));
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return 0;
+            }
+            log_ratelimited(LOG_ERR, "recv error: %s", strerror(errno));
             return -1;
         }
-        char *ptr = memchr(recv_buffer, '\n', received_size);
-        int index = 0;
-        if (ptr != NULL)
-        {
-            index = ptr - recv_buffer;
-        }
-        else
+        packet_buffer_commit(&connection_data->packets, received_size);
+        connection_data->stats.bytes_received += received_size;
+        metrics_count(METRICS_BYTES_RECEIVED, received_size);
+    }
+
+    return 0;
+}
+
+// Apply a complete packet to the output storage and store where its read back starts in
+// @param read_offset.  Appends go through the shard's committer, which batches them with
+// other clients' packets.
+static int apply_packet(const char *packet, size_t packet_size, const struct command *command,
+                        struct connection_thread_args *connection_data, off_t *read_offset)
+{
+    if (command->type == COMMAND_SEEKTO)
+    {
+        if (storage_seekto(connection_data->storage, &command->seekto, read_offset) != 0)
         {
-            index = received_size - 1;
+            log_msg(LOG_DEBUG, "seekto error: %s", strerror(errno));
+            return -1;
         }
+        return 0;
+    }
+
+    if (append_queue_submit(connection_data->append_queue, packet, packet_size) == -1)
+    {
+        log_msg(LOG_ERR, "write error: %s", strerror(errno));
+        return -1;
+    }
+
+    *read_offset = 0;
+
+    return 0;
+}
+
+// Hold back partial frames while several replies are written, or push them out when @param cork
+// is cleared.  Only an optimization, so failures are ignored.
+static void set_cork(int client_fd, int cork)
+{
+    setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
 
-        struct aesd_seekto seekto;
-        seekto.write_cmd = 0;
-        seekto.write_cmd_offset = 0;
-        if (check_for_ioctl_command(&seekto, recv_buffer, received_size) == 0)
+// Block until the non-blocking client socket can take more data, for at most SEND_TIMEOUT_MS.
+// Returns -1 if the client did not make room in time.
+static int wait_for_send_space(int client_fd)
+{
+    struct pollfd pfd = { .fd = client_fd, .events = POLLOUT };
+    if (poll(&pfd, 1, SEND_TIMEOUT_MS) == 0)
+    {
+        log_ratelimited(LOG_INFO, "Client did not read its reply for %d ms, closing", SEND_TIMEOUT_MS);
+        return -1;
+    }
+    return 0;
+}
+
+// Send the whole buffer, handling short sends and a full socket buffer.
+static int send_all(int client_fd, const char *buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent_bytes = send(client_fd, buffer, size, MSG_NOSIGNAL);
+        if (sent_bytes < 0)
         {
-            if (ioctl(output_fd, AESDCHAR_IOCSEEKTO, &seekto) < 0)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                syslog(LOG_DEBUG, "ioctl() error");
-                return -1;
+                if (wait_for_send_space(client_fd) == -1)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
             }
+            log_ratelimited(LOG_ERR, "send error: %s", strerror(errno));
+            return -1;
+        }
+        metrics_count(METRICS_BYTES_SENT, sent_bytes);
+        buffer += sent_bytes;
+        size -= sent_bytes;
+    }
+
+    return 0;
+}
+
+// Copy loop used when the storage has no file that can be spliced to a socket.
+static int send_messages_copy(char *send_buffer, int client_fd, struct storage *storage, off_t offset)
+{
+    ssize_t bytes_read;
+    do
+    {
+        bytes_read = storage_read(storage, &offset, send_buffer, SEND_BUFFER_SIZE);
+        if (bytes_read < 0)
+        {
+            log_msg(LOG_ERR, "read error: %s", strerror(errno));
+            return -1;
+        }
+        if (send_all(client_fd, send_buffer, bytes_read) == -1)
+        {
+            return -1;
+        }
+    } while (bytes_read > 0);
+
+    return 0;
+}
+
+int send_messages(char *send_buffer, int client_fd, struct storage *storage, off_t offset)
+{
+    int output_fd = storage_file(storage);
+    if (output_fd < 0)
+    {
+        return send_messages_copy(send_buffer, client_fd, storage, offset);
+    }
+    // sendfile moves the data from offset straight into the socket without passing through
+    // user space.  Like pread it leaves the file position alone.
+    bool sent_any = false;
+    while (true)
+    {
+        ssize_t sent_bytes = sendfile(client_fd, output_fd, &offset, SENDFILE_CHUNK_SIZE);
+        if (sent_bytes == 0)
+        {
+            return 0;
         }
-        else
+        if (sent_bytes > 0)
         {
-            int write_return = write(output_fd, recv_buffer, index+1);
-            if (write_return == -1)
+            metrics_count(METRICS_BYTES_SENT, sent_bytes);
+            sent_any = true;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (wait_for_send_space(client_fd) == -1)
             {
-                syslog(LOG_ERR, "write error: %s", strerror(errno));
                 return -1;
             }
+            continue;
         }
-        syslog(LOG_INFO, "Message received with sizeof %d", (int)received_size);
-    } while (received_size >= BUFFER_SIZE);
-
-    return 0;
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (!sent_any && (errno == EINVAL || errno == ENOSYS))
+        {
+            return send_messages_copy(send_buffer, client_fd, storage, offset);
+        }
+        log_ratelimited(LOG_ERR, "sendfile error: %s", strerror(errno));
+        return -1;
+    }
 }
 
-int check_for_ioctl_command(struct aesd_seekto* seekto, char *recv_buffer, ssize_t received_size)
+// Answer a readfrom request with only the bytes the client is missing.
+// The cursor reads by stream offset and fails once the rest of the range is evicted, then the
+// connection is closed rather than sending bytes the header does not describe.
+static int send_messages_from(char *send_buffer, int client_fd, struct storage *storage,
+                              const struct readfrom_request *request)
 {
-    char* first_num_start = strchr(recv_buffer, ':');
-    if (first_num_start == NULL) 
+    struct storage_cursor cursor;
+    if (storage_cursor_open(storage, &cursor) != 0)
     {
         return -1;
     }
-    char* first_num_end = strchr(first_num_start, ',');
-    if (first_num_end == NULL) 
+    struct storage_range range;
+    if (storage_cursor_readfrom(&cursor, request, &range) != 0)
     {
+        storage_cursor_close(&cursor);
         return -1;
     }
-    char* second_num_end = strchr(first_num_end, '\n');
-    if (second_num_end == NULL)
+
+    char header[80];
+    int header_size = snprintf(header, sizeof(header), READFROM_REPLY "%llu,%llu,%llu\n",
+                               (unsigned long long)range.start, (unsigned long long)range.end,
+                               (unsigned long long)range.epoch);
+    if (send_all(client_fd, header, header_size) == -1)
     {
+        storage_cursor_close(&cursor);
         return -1;
     }
-    size_t num_size = first_num_end - first_num_start - 1;
-    char first_num_str[10];
-    memset(first_num_str, 0, 10);
-    strncpy(first_num_str, first_num_start+1, num_size);
-    seekto->write_cmd = atoi(first_num_str);
 
-    char second_num_str[10];
-    num_size = second_num_end - first_num_end - 1;
-    memset(second_num_str, 0, 10);
-    strncpy(second_num_str, first_num_end+1, num_size);
-    seekto->write_cmd_offset = atoi(second_num_str);
+    uint64_t remaining = range.end - range.start;
+    while (remaining > 0)
+    {
+        ssize_t bytes_read = storage_cursor_read(&cursor, send_buffer, remaining < SEND_BUFFER_SIZE ? remaining : SEND_BUFFER_SIZE);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read <= 0)
+        {
+            // Part of the range was evicted before it was read, the reply cannot be completed
+            log_ratelimited(LOG_WARNING, "readfrom came up %llu bytes short, closing: %s", (unsigned long long)remaining,
+                            bytes_read < 0 ? strerror(errno) : "end of history");
+            storage_cursor_close(&cursor);
+            return -1;
+        }
+        if (send_all(client_fd, send_buffer, bytes_read) == -1)
+        {
+            storage_cursor_close(&cursor);
+            return -1;
+        }
+        remaining -= bytes_read;
+    }
 
+    storage_cursor_close(&cursor);
     return 0;
 }
 
-int send_messages(char *send_buffer, int client_fd, int output_fd)
+int connection_handle(struct connection_thread_args *connection_data)
 {
-    int bytes_read = BUFFER_SIZE;
-    while (bytes_read > 0)
+    char send_buffer[SEND_BUFFER_SIZE];
+
+    int status = recv_available(connection_data);
+    if (status < 0)
+    {
+        return -1;
+    }
+    uint64_t received_ns = metrics_now_ns();
+
+    // Every complete packet gets its own append and read back, a trailing partial packet waits
+    // in the buffer for the next readiness event.  When a client pipelines several packets the
+    // socket is corked after the first reply so the rest leave in full frames, and uncorked
+    // once the event is done.
+    const char *packet;
+    size_t packet_size;
+    bool corked = false;
+    unsigned int handled = 0;
+    while (packet_buffer_next(&connection_data->packets, &packet, &packet_size))
     {
-        do
+        if (handled++ == 1 && !connection_data->subscribed)
+        {
+            set_cork(connection_data->client_fd, 1);
+            corked = true;
+        }
+        connection_data->stats.packets++;
+        metrics_count(METRICS_PACKETS, 1);
+        struct command command;
+        command_parse(&command, packet, packet_size);
+        if (command.type == COMMAND_SUBSCRIBE)
         {
-            bytes_read = read(output_fd, send_buffer, BUFFER_SIZE);
-            if (bytes_read < 0)
+            if (!connection_data->subscribed && subscription_add(connection_data) != 0)
             {
-                syslog(LOG_ERR, "read error: %s", strerror(errno));
                 return -1;
             }
-            int sent_bytes = send(client_fd, send_buffer, bytes_read, 0);
-            if (sent_bytes < 0)
+            continue;
+        }
+
+        if (command.type == COMMAND_READFROM)
+        {
+            // Only the subscription thread sends to a subscriber, which already gets every new
+            // line.  The command is never part of the history either way.
+            if (connection_data->subscribed)
+            {
+                log_msg(LOG_DEBUG, "Ignoring readfrom from a subscriber");
+                continue;
+            }
+            if (send_messages_from(send_buffer, connection_data->client_fd, connection_data->storage,
+                                   &command.readfrom) == -1)
             {
-                syslog(LOG_ERR, "send error: %s", strerror(errno));
                 return -1;
             }
-        } while (bytes_read >= BUFFER_SIZE);
-    }
-
-    return 0;
-}
-
-void* connection_thread(void* thread_param)
-{
-    char recv_buffer[BUFFER_SIZE];
-    char send_buffer[BUFFER_SIZE];
-
-    struct connection_thread_args* connection_data = (struct connection_thread_args *) thread_param;
+            continue;
+        }
 
-    connection_data->thread_complete = false;
+        off_t read_offset = 0;
+        if (apply_packet(packet, packet_size, &command, connection_data, &read_offset) == -1)
+        {
+            // Start over with a fresh descriptor in case the device went away
+            storage_release_thread(connection_data->storage);
+            return -1;
+        }
+        uint64_t committed_ns = 0;
+        if (command.type == COMMAND_NONE)
+        {
+            committed_ns = metrics_now_ns();
+            metrics_record(METRICS_RECV_TO_COMMIT, committed_ns - received_ns);
+        }
 
-    lock_mutex(connection_data->file_mutex);
-    int output_fd = open(outputfile_name, O_RDWR, 0666);
-    if (output_fd < 0) 
-    {
-        syslog(LOG_ERR, "Open output file error: %s", strerror(errno));
-        unlock_mutex(connection_data->file_mutex);
-        return thread_param;
+        // The read back runs unlocked, the storage serializes access to its buffer.
+        // Subscribers get their line pushed like every other new line instead.
+        if (!connection_data->subscribed &&
+            send_messages(send_buffer, connection_data->client_fd, connection_data->storage, read_offset) == -1)
+        {
+            return -1;
+        }
+        if (committed_ns != 0 && !connection_data->subscribed)
+        {
+            metrics_record(METRICS_COMMIT_TO_SENT, metrics_now_ns() - committed_ns);
+        }
     }
-    // Receiving logic to handle large messages
-    if (recv_messages(recv_buffer, connection_data->client_fd, output_fd) == -1)
+    if (corked)
     {
-        close(connection_data->client_fd);
-        connection_data->thread_complete_success = false;
-        connection_data->thread_complete = true;
-        close(output_fd);
-        unlock_mutex(connection_data->file_mutex);
-        return thread_param;
+        set_cork(connection_data->client_fd, 0);
     }
 
-    if (send_messages(send_buffer, connection_data->client_fd, output_fd) == -1)
+    if (packet_buffer_pending(&connection_data->packets) >= PACKET_MAX_SIZE)
     {
-        close(connection_data->client_fd);
-        connection_data->thread_complete_success = false;
-        connection_data->thread_complete = true;
-        close(output_fd);
-        unlock_mutex(connection_data->file_mutex);
-        return thread_param;
+        log_ratelimited(LOG_WARNING, "Client sent %d bytes without a newline, closing", PACKET_MAX_SIZE);
+        return -1;
     }
-    close(output_fd);
-    unlock_mutex(connection_data->file_mutex);
-
-    // Close the client socket and log it
-    close(connection_data->client_fd);
-    char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(connection_data->client_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-    syslog(LOG_INFO, "Closed connection from %s", ip_str);
 
-    connection_data->thread_complete_success = true;
-    connection_data->thread_complete = true;
+    if (status == 1)
+    {
+        // A last packet without a newline is still appended, the client is gone so it gets no
+        // read back
+        if (packet_buffer_rest(&connection_data->packets, &packet, &packet_size))
+        {
+            struct command command = { .type = COMMAND_NONE };
+            off_t read_offset;
+            if (apply_packet(packet, packet_size, &command, connection_data, &read_offset) == -1)
+            {
+                storage_release_thread(connection_data->storage);
+            }
+        }
+        return -1;
+    }
 
-    return thread_param;
+    return 0;
 }
@@ -3,30 +3,94 @@
 
 #include "../aesd-char-driver/aesd_ioctl.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "queue.h"
+#include "packet_buffer.h"
+#include "command.h"
+#include "append_queue.h"
+#include "storage.h"
+#include "log.h"
+
 // Optional: use these functions to add debug or error prints to your application
-//#define DEBUG_LOG(msg,...)
-#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
-#define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
+#define DEBUG_LOG(msg,...) log_msg(LOG_DEBUG, "threading: " msg, ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) log_msg(LOG_ERR, "threading ERROR: " msg, ##__VA_ARGS__)
+
+// How long a reply may make no progress before the client is dropped, so a client that never
+// reads cannot hold a worker
+#define SEND_TIMEOUT_MS 5000
+
+// Longest packet a client may send.  A connection that sends more without a newline is closed
+// so it cannot make the server buffer without bound.
+#define PACKET_MAX_SIZE (1024 * 1024)
+
+// Prefix of the header line answering a readfrom command
+#define READFROM_REPLY "AESDCHAR_DATA:"
+
+// Upper bound for the -s option, matching /dev/aesdchar0../dev/aesdchar63
+#define MAX_OUTPUT_SHARDS 64
+
+#define OUTPUT_DEFAULT_NAME "/dev/aesdchar"
+// Longest output path accepted by -o, before a shard number is appended
+#define OUTPUT_NAME_MAX 255
+
+/**
+ * Per connection counters, written only by the worker currently handling the connection
+ */
+struct connection_stats {
+    uint64_t packets;          // complete packets received
+    uint64_t bytes_received;
+    struct timespec accepted;  // CLOCK_MONOTONIC time of accept
+};
 
 struct connection_thread_args{
-    pthread_mutex_t *file_mutex;
+    struct append_queue *append_queue;  // commits appends to this connection's shard
+    unsigned int shard;           // which output device the connection appends to
+    struct storage *storage;      // history of the shard, for read backs
     int client_fd;
     struct sockaddr_in client_addr;
     socklen_t client_len;
-    bool thread_complete_success;
-    bool thread_complete;
+    struct packet_buffer packets;  // bytes received but not yet applied
+    bool subscribed;               // new lines are pushed by the subscription thread
+    struct connection_stats stats;
+    STAILQ_ENTRY(connection_thread_args) queue_entries;  // worker pool queue
+    LIST_ENTRY(connection_thread_args) list_entries;     // connections owned by the server
 };
 
-void lock_mutex(pthread_mutex_t *file_mutex);
+/**
+ * Append to @param name, or spread connections over @param num_shards outputs named
+ * <name>0 onwards when there is more than one.  @param name must stay valid and be at most
+ * OUTPUT_NAME_MAX bytes long.  Must be called before any connection is handled.
+ */
+void connection_set_output(const char *name, unsigned int num_shards);
 
-void unlock_mutex(pthread_mutex_t *file_mutex);
+/**
+ * @return the shard a client is assigned to, keyed by its address so a client always lands
+ * on the same device.
+ */
+unsigned int connection_shard_for_client(const struct sockaddr_in *client_addr);
 
-void* connection_thread(void* thread_param);
+/**
+ * @return the path of the output device for @param shard.
+ */
+const char *connection_output_name(unsigned int shard);
 
-int check_for_ioctl_command(struct aesd_seekto* seekto, char *recv_buffer, ssize_t received_size);
+/**
+ * Service a readable client connection: receive what it has sent, append every complete packet
+ * to the output storage and send back its history after each one.  The subscribe command
+ * instead hands the connection to the subscription thread of its device; later packets from a
+ * subscriber are appended without a read back.  Bytes after the last newline are appended
+ * when the client closes, as a packet that is never answered.  Called from a worker pool
+ * thread; the client socket must be non-blocking.  Appends are handed to the connection's
+ * append_queue and waited for, so the read back includes them.  What the storage keeps open
+ * for the calling thread stays open for the next connection, until storage_release_thread().
+ * The caller owns @param connection_data and its client_fd.
+ * @return 0 if the connection should wait for more data, -1 if it should be closed.
+ */
+int connection_handle(struct connection_thread_args *connection_data);
 
 #endif
@@ -0,0 +1,81 @@
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Atomic int log_level = LOG_DEFAULT_LEVEL;
+
+static const char *level_names[] = {
+    [LOG_ERR] = "err",
+    [LOG_WARNING] = "warning",
+    [LOG_NOTICE] = "notice",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+static int clamp_level(int level)
+{
+    if (level < LOG_ERR)
+    {
+        return LOG_ERR;
+    }
+    return level > LOG_DEBUG ? LOG_DEBUG : level;
+}
+
+bool log_ratelimit_allow(struct log_ratelimit *ratelimit, uint32_t *suppressed)
+{
+    // The coarse clock is a vDSO read without a syscall, precise enough for the window
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    *suppressed = 0;
+    uint64_t window_start = atomic_load_explicit(&ratelimit->window_start_ms, memory_order_relaxed);
+    if (window_start == 0 || now_ms - window_start >= LOG_RATELIMIT_INTERVAL_MS)
+    {
+        // Only the thread that moves the window resets it, racing sites may log a few extra
+        if (atomic_compare_exchange_strong(&ratelimit->window_start_ms, &window_start, now_ms))
+        {
+            atomic_store_explicit(&ratelimit->logged, 0, memory_order_relaxed);
+        }
+    }
+    if (atomic_fetch_add_explicit(&ratelimit->logged, 1, memory_order_relaxed) >= LOG_RATELIMIT_BURST)
+    {
+        atomic_fetch_add_explicit(&ratelimit->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = atomic_exchange_explicit(&ratelimit->suppressed, 0, memory_order_relaxed);
+    return true;
+}
+
+int log_parse_level(const char *name)
+{
+    for (int level = LOG_ERR; level <= LOG_DEBUG; level++)
+    {
+        if (strcmp(name, level_names[level]) == 0)
+        {
+            return level;
+        }
+    }
+    char *end;
+    long level = strtol(name, &end, 10);
+    if (*name == '\0' || *end != '\0' || level < LOG_ERR || level > LOG_DEBUG)
+    {
+        return -1;
+    }
+    return level;
+}
+
+void log_set_level(int level)
+{
+    atomic_store_explicit(&log_level, clamp_level(level), memory_order_relaxed);
+}
+
+void log_adjust_level(int steps)
+{
+    int level = atomic_load_explicit(&log_level, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&log_level, &level, clamp_level(level + steps),
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+/**
+ * Leveled logging on top of syslog.  Levels are the syslog priorities, LOG_ERR being the least
+ * verbose level that can be selected.
+ *
+ * Sites above LOG_COMPILE_LEVEL compile to nothing, so a build with
+ *     make CFLAGS="-Wall -Werror -DLOG_COMPILE_LEVEL=LOG_INFO"
+ * drops every debug message including the evaluation of its arguments.  The remaining sites
+ * check the runtime level with a single relaxed load before formatting anything; it is set with
+ * -l and moved by SIGUSR1 (more verbose) and SIGUSR2 (less verbose).
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+// Level in effect until -l or a signal changes it
+#define LOG_DEFAULT_LEVEL LOG_INFO
+
+// A rate limited site logs at most LOG_RATELIMIT_BURST messages per interval
+#define LOG_RATELIMIT_INTERVAL_MS 5000
+#define LOG_RATELIMIT_BURST 10
+
+extern _Atomic int log_level;
+
+static inline bool log_enabled(int priority)
+{
+    return priority <= LOG_COMPILE_LEVEL &&
+           priority <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+#define log_msg(priority, ...)                                                                  \
+    do {                                                                                        \
+        if (log_enabled(priority)) {                                                            \
+            syslog(priority, __VA_ARGS__);                                                      \
+        }                                                                                       \
+    } while (0)
+
+/**
+ * Per call site state of log_ratelimited().
+ */
+struct log_ratelimit {
+    _Atomic uint64_t window_start_ms;
+    _Atomic uint32_t logged;       // messages logged in the current window
+    _Atomic uint32_t suppressed;   // messages dropped since the last one logged
+};
+
+/**
+ * For sites a client can trigger at will, e.g. per connection errors.  Messages over the burst
+ * are dropped and counted, the next one logged reports how many were lost.
+ */
+#define log_ratelimited(priority, ...)                                                          \
+    do {                                                                                        \
+        static struct log_ratelimit log_site_ratelimit;                                         \
+        uint32_t log_site_suppressed;                                                           \
+        if (log_enabled(priority) && log_ratelimit_allow(&log_site_ratelimit, &log_site_suppressed)) { \
+            if (log_site_suppressed > 0) {                                                      \
+                syslog(priority, "%u similar messages suppressed", log_site_suppressed);        \
+            }                                                                                   \
+            syslog(priority, __VA_ARGS__);                                                      \
+        }                                                                                       \
+    } while (0)
+
+/**
+ * @return true if the site guarded by @param ratelimit may log now, storing the number of
+ * messages dropped since it last could in @param suppressed.
+ */
+bool log_ratelimit_allow(struct log_ratelimit *ratelimit, uint32_t *suppressed);
+
+/**
+ * Parse a level name (err, warning, notice, info, debug) or syslog priority number.
+ * @return the level, -1 if @param name is not one.
+ */
+int log_parse_level(const char *name);
+
+void log_set_level(int level);
+
+/**
+ * Move the runtime level by @param steps towards LOG_DEBUG (positive) or LOG_ERR (negative).
+ * Async-signal-safe.
+ */
+void log_adjust_level(int steps);
+
+#endif
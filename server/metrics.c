@@ -0,0 +1,220 @@
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_LINE_SIZE 64
+
+static const char *counter_names[METRICS_COUNTERS] = {
+    [METRICS_CONNECTIONS_ACCEPTED] = "aesdsocket_connections_accepted_total",
+    [METRICS_CONNECTIONS_CLOSED] = "aesdsocket_connections_closed_total",
+    [METRICS_CONNECTIONS_REJECTED] = "aesdsocket_connections_rejected_total",
+    [METRICS_BYTES_RECEIVED] = "aesdsocket_bytes_received_total",
+    [METRICS_BYTES_SENT] = "aesdsocket_bytes_sent_total",
+    [METRICS_PACKETS] = "aesdsocket_packets_total",
+    [METRICS_COMMIT_BATCHES] = "aesdsocket_commit_batches_total",
+    [METRICS_COMMIT_PACKETS] = "aesdsocket_commit_packets_total",
+};
+
+static const char *histogram_names[METRICS_HISTOGRAMS] = {
+    [METRICS_RECV_TO_COMMIT] = "aesdsocket_recv_to_commit_ns",
+    [METRICS_COMMIT_TO_SENT] = "aesdsocket_commit_to_sent_ns",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+// Blocks of every thread that recorded something
+static struct thread_metrics *all_metrics;
+static pthread_mutex_t all_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct thread_metrics *local_metrics;
+
+// Only the owning thread writes, so a plain load and store is enough; the atomics just keep
+// the concurrent reads in metrics_format() well defined.
+static inline void add_relaxed(_Atomic uint64_t *value, uint64_t amount)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static struct thread_metrics *get_local_metrics(void)
+{
+    if (local_metrics == NULL)
+    {
+        struct thread_metrics *metrics = aligned_alloc(CACHE_LINE_SIZE,
+            (sizeof(struct thread_metrics) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+        if (metrics == NULL)
+        {
+            return NULL;
+        }
+        memset(metrics, 0, sizeof(struct thread_metrics));
+        pthread_mutex_lock(&all_metrics_mutex);
+        metrics->next = all_metrics;
+        all_metrics = metrics;
+        pthread_mutex_unlock(&all_metrics_mutex);
+        local_metrics = metrics;
+    }
+    return local_metrics;
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics_count(enum metrics_counter counter, uint64_t value)
+{
+    struct thread_metrics *metrics = get_local_metrics();
+    if (metrics != NULL)
+    {
+        add_relaxed(&metrics->counters[counter], value);
+    }
+}
+
+static size_t bucket_index(uint64_t value)
+{
+    if (value < METRICS_HISTOGRAM_SUB_BUCKETS)
+    {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    uint64_t sub_bucket = (value >> (exponent - METRICS_HISTOGRAM_SUB_BITS)) & (METRICS_HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+// Largest value that falls into bucket @param index
+static uint64_t bucket_upper_bound(size_t index)
+{
+    if (index < METRICS_HISTOGRAM_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int exponent = index / METRICS_HISTOGRAM_SUB_BUCKETS + METRICS_HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub_bucket = index % METRICS_HISTOGRAM_SUB_BUCKETS;
+    uint64_t lower = (METRICS_HISTOGRAM_SUB_BUCKETS + sub_bucket) << (exponent - METRICS_HISTOGRAM_SUB_BITS);
+    return lower + ((uint64_t)1 << (exponent - METRICS_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void metrics_record(enum metrics_histogram histogram, uint64_t value)
+{
+    struct thread_metrics *metrics = get_local_metrics();
+    if (metrics == NULL)
+    {
+        return;
+    }
+    struct metrics_histogram_data *data = &metrics->histograms[histogram];
+    add_relaxed(&data->buckets[bucket_index(value)], 1);
+    add_relaxed(&data->count, 1);
+    add_relaxed(&data->sum, value);
+    if (value > atomic_load_explicit(&data->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&data->max, value, memory_order_relaxed);
+    }
+}
+
+// snprintf that keeps appending at *length and never runs past size
+#define APPEND(buffer, size, length, ...) \
+    do { \
+        if (*(length) < (size)) { \
+            int written = snprintf((buffer) + *(length), (size) - *(length), __VA_ARGS__); \
+            *(length) += written > 0 ? (size_t)written : 0; \
+        } \
+    } while (0)
+
+static void format_histogram(char *buffer, size_t size, size_t *length, enum metrics_histogram histogram)
+{
+    // Merged on the heap, the buckets of one histogram take about 8 KiB
+    uint64_t *buckets = calloc(METRICS_HISTOGRAM_BUCKETS, sizeof(uint64_t));
+    if (buckets == NULL)
+    {
+        return;
+    }
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    for (struct thread_metrics *metrics = all_metrics; metrics != NULL; metrics = metrics->next)
+    {
+        struct metrics_histogram_data *data = &metrics->histograms[histogram];
+        for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+        {
+            buckets[i] += atomic_load_explicit(&data->buckets[i], memory_order_relaxed);
+        }
+        count += atomic_load_explicit(&data->count, memory_order_relaxed);
+        sum += atomic_load_explicit(&data->sum, memory_order_relaxed);
+        uint64_t thread_max = atomic_load_explicit(&data->max, memory_order_relaxed);
+        max = thread_max > max ? thread_max : max;
+    }
+
+    const char *name = histogram_names[histogram];
+    APPEND(buffer, size, length, "%s_count %llu\n", name, (unsigned long long)count);
+    APPEND(buffer, size, length, "%s_sum %llu\n", name, (unsigned long long)sum);
+    APPEND(buffer, size, length, "%s_max %llu\n", name, (unsigned long long)max);
+
+    // Buckets are summed without stopping the writers, so use their own total for the ranks
+    uint64_t total = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        total += buckets[i];
+    }
+    size_t bucket = 0;
+    uint64_t seen = 0;
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+    {
+        uint64_t rank = (uint64_t)(quantiles[q] * total + 0.5);
+        rank = rank > 0 ? rank : 1;
+        while (bucket < METRICS_HISTOGRAM_BUCKETS && seen + buckets[bucket] < rank)
+        {
+            seen += buckets[bucket];
+            bucket++;
+        }
+        uint64_t value = total == 0 ? 0 : bucket_upper_bound(bucket);
+        APPEND(buffer, size, length, "%s{quantile=\"%g\"} %llu\n", name, quantiles[q],
+               (unsigned long long)(value < max ? value : max));
+    }
+    free(buckets);
+}
+
+size_t metrics_format(char *buffer, size_t size)
+{
+    uint64_t totals[METRICS_COUNTERS] = {0};
+    size_t length = 0;
+
+    pthread_mutex_lock(&all_metrics_mutex);
+    for (struct thread_metrics *metrics = all_metrics; metrics != NULL; metrics = metrics->next)
+    {
+        for (size_t i = 0; i < METRICS_COUNTERS; i++)
+        {
+            totals[i] += atomic_load_explicit(&metrics->counters[i], memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < METRICS_COUNTERS; i++)
+    {
+        APPEND(buffer, size, &length, "%s %llu\n", counter_names[i], (unsigned long long)totals[i]);
+    }
+    uint64_t closed = totals[METRICS_CONNECTIONS_CLOSED];
+    uint64_t accepted = totals[METRICS_CONNECTIONS_ACCEPTED];
+    APPEND(buffer, size, &length, "aesdsocket_connections_active %llu\n",
+           (unsigned long long)(accepted > closed ? accepted - closed : 0));
+    for (size_t i = 0; i < METRICS_HISTOGRAMS; i++)
+    {
+        format_histogram(buffer, size, &length, i);
+    }
+    pthread_mutex_unlock(&all_metrics_mutex);
+
+    return length < size ? length : (size > 0 ? size - 1 : 0);
+}
+
+void metrics_destroy(void)
+{
+    pthread_mutex_lock(&all_metrics_mutex);
+    while (all_metrics != NULL)
+    {
+        struct thread_metrics *next = all_metrics->next;
+        free(all_metrics);
+        all_metrics = next;
+    }
+    pthread_mutex_unlock(&all_metrics_mutex);
+    local_metrics = NULL;
+}
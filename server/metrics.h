@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sub-buckets per power of two in a histogram, bounding the relative error to 1/16
+#define METRICS_HISTOGRAM_SUB_BITS 4
+#define METRICS_HISTOGRAM_SUB_BUCKETS (1 << METRICS_HISTOGRAM_SUB_BITS)
+#define METRICS_HISTOGRAM_BUCKETS ((64 - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_BUCKETS)
+
+enum metrics_counter {
+    METRICS_CONNECTIONS_ACCEPTED,
+    METRICS_CONNECTIONS_CLOSED,
+    METRICS_CONNECTIONS_REJECTED,  // over the -c limit
+    METRICS_BYTES_RECEIVED,
+    METRICS_BYTES_SENT,
+    METRICS_PACKETS,
+    METRICS_COMMIT_BATCHES,        // writev() calls of the append queues
+    METRICS_COMMIT_PACKETS,        // packets appended by them
+    METRICS_COUNTERS
+};
+
+enum metrics_histogram {
+    METRICS_RECV_TO_COMMIT,        // packet received until its append completed, ns
+    METRICS_COMMIT_TO_SENT,        // append completed until the last byte of the read back was sent, ns
+    METRICS_HISTOGRAMS
+};
+
+/**
+ * Log-linear histogram in the style of HdrHistogram: values below 16 have a bucket each,
+ * above that every power of two is split into 16 equal buckets.
+ */
+struct metrics_histogram_data {
+    _Atomic uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+/**
+ * Every thread records into its own block, allocated on first use, so the hot path never
+ * writes memory shared with another thread.  Blocks are only read, and summed, when the
+ * metrics are formatted.
+ */
+struct thread_metrics {
+    _Atomic uint64_t counters[METRICS_COUNTERS];
+    struct metrics_histogram_data histograms[METRICS_HISTOGRAMS];
+    struct thread_metrics *next;
+};
+
+/**
+ * @return the CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * Add @param value to @param counter for the calling thread.
+ */
+void metrics_count(enum metrics_counter counter, uint64_t value);
+
+/**
+ * Record @param value in @param histogram for the calling thread.
+ */
+void metrics_record(enum metrics_histogram histogram, uint64_t value);
+
+/**
+ * Write the totals of all threads to @param buffer as "name value" lines, histograms as
+ * count, sum, max and quantiles.
+ * @return the length of the text, truncated to fit @param size.
+ */
+size_t metrics_format(char *buffer, size_t size);
+
+/**
+ * Release the blocks of all threads.  No thread may record metrics afterwards.
+ */
+void metrics_destroy(void);
+
+#endif
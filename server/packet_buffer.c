@@ -0,0 +1,102 @@
+#include "packet_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+void packet_buffer_init(struct packet_buffer *buffer)
+{
+    memset(buffer, 0, sizeof(struct packet_buffer));
+}
+
+void packet_buffer_free(struct packet_buffer *buffer)
+{
+    free(buffer->data);
+    packet_buffer_init(buffer);
+}
+
+void packet_buffer_reset(struct packet_buffer *buffer)
+{
+    if (buffer->capacity > PACKET_BUFFER_RETAIN_CAPACITY)
+    {
+        packet_buffer_free(buffer);
+        return;
+    }
+    buffer->size = 0;
+    buffer->start = 0;
+    buffer->scanned = 0;
+}
+
+char *packet_buffer_reserve(struct packet_buffer *buffer, size_t min_free, size_t *available)
+{
+    // Drop packets that were already handed out so the partial packet starts at offset 0
+    if (buffer->start > 0)
+    {
+        size_t remaining = buffer->size - buffer->start;
+        memmove(buffer->data, buffer->data + buffer->start, remaining);
+        buffer->size = remaining;
+        buffer->scanned -= buffer->start;
+        buffer->start = 0;
+    }
+
+    if (buffer->capacity - buffer->size < min_free)
+    {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : PACKET_BUFFER_INITIAL_CAPACITY;
+        while (capacity - buffer->size < min_free)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    *available = buffer->capacity - buffer->size;
+    return buffer->data + buffer->size;
+}
+
+void packet_buffer_commit(struct packet_buffer *buffer, size_t count)
+{
+    buffer->size += count;
+}
+
+bool packet_buffer_next(struct packet_buffer *buffer, const char **packet, size_t *packet_size)
+{
+    if (buffer->scanned == buffer->size)
+    {
+        return false;
+    }
+    char *newline = memchr(buffer->data + buffer->scanned, '\n', buffer->size - buffer->scanned);
+    if (newline == NULL)
+    {
+        buffer->scanned = buffer->size;
+        return false;
+    }
+
+    size_t end = newline - buffer->data + 1;
+    *packet = buffer->data + buffer->start;
+    *packet_size = end - buffer->start;
+    buffer->start = end;
+    buffer->scanned = end;
+    return true;
+}
+
+bool packet_buffer_rest(struct packet_buffer *buffer, const char **packet, size_t *packet_size)
+{
+    if (buffer->start == buffer->size)
+    {
+        return false;
+    }
+    *packet = buffer->data + buffer->start;
+    *packet_size = buffer->size - buffer->start;
+    buffer->start = buffer->size;
+    buffer->scanned = buffer->size;
+    return true;
+}
+
+size_t packet_buffer_pending(const struct packet_buffer *buffer)
+{
+    return buffer->size - buffer->start;
+}
@@ -0,0 +1,76 @@
+#ifndef PACKET_BUFFER_H
+#define PACKET_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PACKET_BUFFER_INITIAL_CAPACITY 1024
+// Largest storage packet_buffer_reset() keeps around
+#define PACKET_BUFFER_RETAIN_CAPACITY (16 * 1024)
+
+/**
+ * Per-connection assembly buffer for newline terminated packets.
+ * Received bytes are appended at the end, complete packets are handed out from the front.
+ * Storage doubles when full and each byte is scanned for a newline only once.
+ */
+struct packet_buffer {
+    char *data;
+    /**
+     * Bytes currently held in data, including consumed packets not yet compacted away
+     */
+    size_t size;
+    size_t capacity;
+    /**
+     * Offset of the first byte that has not been returned as part of a packet
+     */
+    size_t start;
+    /**
+     * Offset of the first byte not yet searched for a newline
+     */
+    size_t scanned;
+};
+
+void packet_buffer_init(struct packet_buffer *buffer);
+
+void packet_buffer_free(struct packet_buffer *buffer);
+
+/**
+ * Drop all buffered bytes.  Storage up to PACKET_BUFFER_RETAIN_CAPACITY is kept for the next
+ * user of the buffer, anything larger is released.
+ */
+void packet_buffer_reset(struct packet_buffer *buffer);
+
+/**
+ * Make room for at least @param min_free more bytes, compacting consumed packets away and
+ * doubling the capacity as needed.
+ * @return a pointer to the free space at the end of the buffer, or NULL if allocation failed.
+ * The number of bytes available there is stored in @param available.
+ */
+char *packet_buffer_reserve(struct packet_buffer *buffer, size_t min_free, size_t *available);
+
+/**
+ * Account for @param count bytes written into the space returned by packet_buffer_reserve().
+ */
+void packet_buffer_commit(struct packet_buffer *buffer, size_t count);
+
+/**
+ * Return the next complete packet, including its trailing newline, through @param packet and
+ * @param packet_size.  The packet stays valid until the next call to packet_buffer_reserve().
+ * @return false when no complete packet is buffered.
+ */
+bool packet_buffer_next(struct packet_buffer *buffer, const char **packet, size_t *packet_size);
+
+/**
+ * Hand out the bytes after the last complete packet through @param packet and
+ * @param packet_size, as if they ended in a newline.  Call only once packet_buffer_next()
+ * returned false.
+ * @return false when there are no such bytes.
+ */
+bool packet_buffer_rest(struct packet_buffer *buffer, const char **packet, size_t *packet_size);
+
+/**
+ * @return the number of buffered bytes that are not yet part of a complete packet.
+ */
+size_t packet_buffer_pending(const struct packet_buffer *buffer);
+
+#endif
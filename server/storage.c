@@ -0,0 +1,44 @@
+#include "storage.h"
+#include <string.h>
+
+struct storage *storage_open(enum storage_backend backend, const char *name, unsigned int index, size_t entries)
+{
+    switch (backend)
+    {
+        case STORAGE_CHARDEV:
+            return storage_chardev_open(name, index);
+        case STORAGE_MEMORY:
+            return storage_memory_open(name, index, entries);
+    }
+    return NULL;
+}
+
+int storage_parse_backend(const char *name)
+{
+    if (strcmp(name, "chardev") == 0)
+    {
+        return STORAGE_CHARDEV;
+    }
+    if (strcmp(name, "memory") == 0)
+    {
+        return STORAGE_MEMORY;
+    }
+    return -1;
+}
+
+void storage_readfrom_range(const struct readfrom_request *request, uint64_t base_offset,
+                            uint64_t total_bytes, uint64_t epoch, struct storage_range *range)
+{
+    range->end = base_offset + total_bytes;
+    range->epoch = epoch;
+    range->start = request->offset;
+    if (range->start > range->end || (request->has_epoch && request->epoch != epoch))
+    {
+        // The client's position comes from another history, send all of this one
+        range->start = base_offset;
+    }
+    else if (range->start < base_offset)
+    {
+        range->start = base_offset;
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "command.h"
+
+// History kept by the memory backend unless -e says otherwise, as many writes as the driver keeps
+#define STORAGE_MEMORY_DEFAULT_ENTRIES 10
+#define STORAGE_MEMORY_MAX_ENTRIES (1024 * 1024)
+
+enum storage_backend {
+    STORAGE_CHARDEV,      // an aesdchar device, or any file opened by path
+    STORAGE_MEMORY,       // an aesd_circular_buffer inside the server process
+};
+
+/**
+ * Where the appends of one shard are kept.  Every backend behaves like the aesdchar driver:
+ * each newline terminated packet becomes an entry, only the newest entries are retained, and
+ * positions in the history count from the oldest retained byte.
+ * Backends embed this struct as their first member.
+ */
+struct storage {
+    const struct storage_ops *ops;
+    const char *name;     // device path, or the label of an in-process history
+    unsigned int index;   // shard number, unique among the storages in use
+};
+
+/**
+ * A reader positioned by stream offset, counting every byte ever appended, which keeps its
+ * place while older entries are evicted.  A position that was evicted moves on to the oldest
+ * retained byte, like a follow mode reader of the driver, unless the cursor is exact.
+ */
+struct storage_cursor {
+    struct storage *storage;
+    int poll_fd;          // readable when storage_cursor_read() may return more data
+    int fd;               // backend state
+    uint64_t position;    // backend state
+    bool exact;           // set by cursor_readfrom(): never skip evicted bytes
+};
+
+/**
+ * The part of the history answering a readfrom request, in stream offsets
+ */
+struct storage_range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t epoch;       // random, chosen when the history was created
+};
+
+struct storage_ops {
+    /**
+     * Append @param count newline terminated packets, each becoming one entry.  The vector may
+     * be modified.  Only ever called from the shard's append_queue thread.
+     * @return the number of packets appended completely, in order, which is less than
+     * @param count with errno set if the rest failed.
+     */
+    int (*append)(struct storage *storage, struct iovec *iov, int count);
+    /**
+     * Let go of what append() keeps open, called by the append_queue thread once it is idle.
+     */
+    void (*append_release)(struct storage *storage);
+    /**
+     * Store the read back position of @param seekto in @param offset.
+     */
+    int (*seekto)(struct storage *storage, const struct aesd_seekto *seekto, off_t *offset);
+    /**
+     * Copy up to @param size bytes of the history from @param offset on and advance it.
+     * @return the number of bytes copied, 0 at the end of the history, -1 on error.
+     */
+    ssize_t (*read)(struct storage *storage, off_t *offset, char *buffer, size_t size);
+    /**
+     * @return a descriptor of the calling thread that sendfile() can read the history from,
+     * positioned like read(), or -1 if the backend has none.
+     */
+    int (*file)(struct storage *storage);
+    /**
+     * Close what the calling thread keeps open for seekto(), read() and file().
+     */
+    void (*release_thread)(struct storage *storage);
+    /**
+     * Position @param cursor at the end of the history.
+     */
+    int (*cursor_open)(struct storage *storage, struct storage_cursor *cursor);
+    /**
+     * Position @param cursor for a readfrom request and store the range to send in @param range.
+     * The cursor becomes exact: once the bytes it would read next are evicted, cursor_read()
+     * fails with ESTALE instead of moving on, so a reply never mixes up offsets.
+     */
+    int (*cursor_readfrom)(struct storage_cursor *cursor, const struct readfrom_request *request,
+                           struct storage_range *range);
+    /**
+     * @return the number of bytes read, -1 with errno EAGAIN at the end of the history, 0 or
+     * -1 with another errno if the history cannot be followed any further.  Never blocks.
+     * An exact cursor returns 0 at the end of the history.
+     */
+    ssize_t (*cursor_read)(struct storage_cursor *cursor, char *buffer, size_t size);
+    void (*cursor_close)(struct storage_cursor *cursor);
+    void (*destroy)(struct storage *storage);
+};
+
+/**
+ * Open the history @param name of shard @param index with @param backend.  The memory backend
+ * keeps @param entries writes; the char device decides for itself.  @param name must stay valid.
+ * @return NULL if the backend could not be set up.
+ */
+struct storage *storage_open(enum storage_backend backend, const char *name, unsigned int index, size_t entries);
+
+/**
+ * @return the backend called @param name ("chardev" or "memory"), -1 if there is none.
+ */
+int storage_parse_backend(const char *name);
+
+/**
+ * Apply the readfrom rules to a history starting at stream offset @param base_offset and
+ * holding @param total_bytes: send from the requested offset, from the oldest retained byte if
+ * that was evicted, or everything if the offset is from another history, one with a different
+ * @param epoch.
+ */
+void storage_readfrom_range(const struct readfrom_request *request, uint64_t base_offset,
+                            uint64_t total_bytes, uint64_t epoch, struct storage_range *range);
+
+struct storage *storage_chardev_open(const char *name, unsigned int index);
+struct storage *storage_memory_open(const char *name, unsigned int index, size_t entries);
+
+static inline int storage_append(struct storage *storage, struct iovec *iov, int count)
+{
+    return storage->ops->append(storage, iov, count);
+}
+
+static inline void storage_append_release(struct storage *storage)
+{
+    storage->ops->append_release(storage);
+}
+
+static inline int storage_seekto(struct storage *storage, const struct aesd_seekto *seekto, off_t *offset)
+{
+    return storage->ops->seekto(storage, seekto, offset);
+}
+
+static inline ssize_t storage_read(struct storage *storage, off_t *offset, char *buffer, size_t size)
+{
+    return storage->ops->read(storage, offset, buffer, size);
+}
+
+static inline int storage_file(struct storage *storage)
+{
+    return storage->ops->file(storage);
+}
+
+static inline void storage_release_thread(struct storage *storage)
+{
+    storage->ops->release_thread(storage);
+}
+
+static inline int storage_cursor_open(struct storage *storage, struct storage_cursor *cursor)
+{
+    return storage->ops->cursor_open(storage, cursor);
+}
+
+static inline int storage_cursor_readfrom(struct storage_cursor *cursor, const struct readfrom_request *request,
+                                          struct storage_range *range)
+{
+    return cursor->storage->ops->cursor_readfrom(cursor, request, range);
+}
+
+static inline ssize_t storage_cursor_read(struct storage_cursor *cursor, char *buffer, size_t size)
+{
+    return cursor->storage->ops->cursor_read(cursor, buffer, size);
+}
+
+static inline void storage_cursor_close(struct storage_cursor *cursor)
+{
+    cursor->storage->ops->cursor_close(cursor);
+}
+
+static inline void storage_close(struct storage *storage)
+{
+    storage->ops->destroy(storage);
+}
+
+#endif
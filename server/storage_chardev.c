@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "connection_thread.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/**
+ * The aesdchar driver behind a path.  The append_queue thread keeps its own descriptor, every
+ * other thread gets one on first use and keeps it across connections.  Reads use explicit
+ * offsets, so the file position of a shared descriptor never matters.
+ */
+struct chardev_storage {
+    struct storage storage;
+    int append_fd;        // owned by the append_queue thread, -1 while idle
+};
+
+static __thread int device_fds[MAX_OUTPUT_SHARDS];
+static __thread bool device_open[MAX_OUTPUT_SHARDS];
+
+static int chardev_file(struct storage *storage)
+{
+    unsigned int index = storage->index;
+    if (!device_open[index])
+    {
+        device_fds[index] = open(storage->name, O_RDWR | O_CLOEXEC);
+        if (device_fds[index] < 0)
+        {
+            log_msg(LOG_ERR, "Open output file error: %s", strerror(errno));
+            return -1;
+        }
+        device_open[index] = true;
+    }
+    return device_fds[index];
+}
+
+static void chardev_release_thread(struct storage *storage)
+{
+    if (device_open[storage->index])
+    {
+        close(device_fds[storage->index]);
+        device_open[storage->index] = false;
+    }
+}
+
+// Write the iovecs completely, continuing after short writes.
+// Returns how many were written completely, fewer than @param count on error.
+static int write_all(int fd, struct iovec *iov, int count)
+{
+    int completed = 0;
+    while (completed < count)
+    {
+        ssize_t written = writev(fd, iov, count - completed);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return completed;
+        }
+        while (completed < count && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            completed++;
+        }
+        if (completed < count)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return completed;
+}
+
+static int chardev_append(struct storage *storage, struct iovec *iov, int count)
+{
+    struct chardev_storage *chardev = (struct chardev_storage *)storage;
+    if (chardev->append_fd < 0)
+    {
+        chardev->append_fd = open(storage->name, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (chardev->append_fd < 0)
+        {
+            int error = errno;
+            log_msg(LOG_ERR, "Open %s for appends error: %s", storage->name, strerror(error));
+            errno = error;
+            return 0;
+        }
+    }
+    return write_all(chardev->append_fd, iov, count);
+}
+
+static void chardev_append_release(struct storage *storage)
+{
+    struct chardev_storage *chardev = (struct chardev_storage *)storage;
+    if (chardev->append_fd >= 0)
+    {
+        close(chardev->append_fd);
+        chardev->append_fd = -1;
+    }
+}
+
+static int chardev_seekto(struct storage *storage, const struct aesd_seekto *seekto, off_t *offset)
+{
+    int fd = chardev_file(storage);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // The driver returns the position it seeked to, no lock needed.  It is a long, which the
+    // int returned by ioctl() would truncate past 2 GiB, so the syscall is made directly.
+    struct aesd_seekto request = *seekto;
+    long position = syscall(SYS_ioctl, fd, AESDCHAR_IOCSEEKTO, &request);
+    if (position < 0)
+    {
+        return -1;
+    }
+    *offset = position;
+    return 0;
+}
+
+static ssize_t chardev_read(struct storage *storage, off_t *offset, char *buffer, size_t size)
+{
+    int fd = chardev_file(storage);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t bytes_read = pread(fd, buffer, size, *offset);
+    if (bytes_read > 0)
+    {
+        *offset += bytes_read;
+    }
+    return bytes_read;
+}
+
+// The cursor is a descriptor of its own in follow mode, where the driver keeps the file
+// position anchored to stream offsets.  It is non-blocking so a read at the end fails
+// instead of waiting.
+static int chardev_cursor_open(struct storage *storage, struct storage_cursor *cursor)
+{
+    cursor->storage = storage;
+    cursor->exact = false;
+    cursor->fd = open(storage->name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (cursor->fd < 0)
+    {
+        log_msg(LOG_ERR, "Open %s for reading error: %s", storage->name, strerror(errno));
+        return -1;
+    }
+    uint32_t follow = 1;
+    if (ioctl(cursor->fd, AESDCHAR_IOCFOLLOW, &follow) < 0 || lseek(cursor->fd, 0, SEEK_END) < 0)
+    {
+        log_msg(LOG_ERR, "Follow %s error: %s", storage->name, strerror(errno));
+        close(cursor->fd);
+        return -1;
+    }
+    cursor->poll_fd = cursor->fd;
+    return 0;
+}
+
+// A readfrom cursor leaves follow mode and reads by stream offset instead, with the oldest
+// retained offset checked around every read.  A follow mode descriptor would rebase silently
+// when the range is evicted, and the reply would carry bytes from another offset.
+static int chardev_cursor_readfrom(struct storage_cursor *cursor, const struct readfrom_request *request,
+                                   struct storage_range *range)
+{
+    struct aesd_entry_table table;
+    memset(&table, 0, sizeof(table));
+    uint32_t follow = 0;
+    if (ioctl(cursor->fd, AESDCHAR_IOCFOLLOW, &follow) < 0 || ioctl(cursor->fd, AESDCHAR_IOCQENTRIES, &table) < 0)
+    {
+        log_msg(LOG_ERR, "readfrom could not query the output file: %s", strerror(errno));
+        return -1;
+    }
+    storage_readfrom_range(request, table.base_offset, table.total_bytes, table.epoch, range);
+    cursor->position = range->start;
+    cursor->exact = true;
+    return 0;
+}
+
+// Read at the cursor's stream offset.  Positions are relative to the oldest entry, so the read
+// only counts if no entry was evicted between looking up that entry and reading.
+static ssize_t chardev_cursor_read_exact(struct storage_cursor *cursor, char *buffer, size_t size)
+{
+    struct aesd_entry_table before;
+    struct aesd_entry_table after;
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    if (ioctl(cursor->fd, AESDCHAR_IOCQENTRIES, &before) < 0)
+    {
+        return -1;
+    }
+    if (cursor->position < before.base_offset)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+    ssize_t bytes_read = pread(cursor->fd, buffer, size, cursor->position - before.base_offset);
+    if (bytes_read <= 0)
+    {
+        return bytes_read;
+    }
+    if (ioctl(cursor->fd, AESDCHAR_IOCQENTRIES, &after) < 0)
+    {
+        return -1;
+    }
+    if (after.base_offset != before.base_offset)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+    cursor->position += bytes_read;
+    return bytes_read;
+}
+
+static ssize_t chardev_cursor_read(struct storage_cursor *cursor, char *buffer, size_t size)
+{
+    if (cursor->exact)
+    {
+        return chardev_cursor_read_exact(cursor, buffer, size);
+    }
+    return read(cursor->fd, buffer, size);
+}
+
+static void chardev_cursor_close(struct storage_cursor *cursor)
+{
+    close(cursor->fd);
+}
+
+static void chardev_destroy(struct storage *storage)
+{
+    chardev_append_release(storage);
+    free(storage);
+}
+
+static const struct storage_ops chardev_ops = {
+    .append = chardev_append,
+    .append_release = chardev_append_release,
+    .seekto = chardev_seekto,
+    .read = chardev_read,
+    .file = chardev_file,
+    .release_thread = chardev_release_thread,
+    .cursor_open = chardev_cursor_open,
+    .cursor_readfrom = chardev_cursor_readfrom,
+    .cursor_read = chardev_cursor_read,
+    .cursor_close = chardev_cursor_close,
+    .destroy = chardev_destroy,
+};
+
+struct storage *storage_chardev_open(const char *name, unsigned int index)
+{
+    struct chardev_storage *chardev = calloc(1, sizeof(struct chardev_storage));
+    if (chardev == NULL)
+    {
+        log_msg(LOG_ERR, "storage memory allocation failed");
+        return NULL;
+    }
+    chardev->storage.ops = &chardev_ops;
+    chardev->storage.name = name;
+    chardev->storage.index = index;
+    chardev->append_fd = -1;
+    return &chardev->storage;
+}
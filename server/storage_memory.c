@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include "storage.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+
+/**
+ * The history kept in the server process with the driver's circular buffer, so the server runs
+ * without the kernel module and appends and read backs stay out of the kernel.
+ * Appends take the lock exclusively once per batch, read backs share it.
+ */
+struct memory_storage {
+    struct storage storage;
+    pthread_rwlock_t lock;             // protects buffer
+    struct aesd_circular_buffer buffer;
+    uint64_t epoch;                    // random, identifies this history in readfrom replies
+    /**
+     * Used by the append_queue thread only: the tail of a write without its newline yet, and
+     * the lines of the current batch and the buffers they evict
+     */
+    char *pending;
+    size_t pending_size;
+    struct aesd_buffer_entry *lines;
+    size_t lines_capacity;
+    const char **evicted;
+    pthread_mutex_t followers_mutex;   // protects followers
+    int *followers;                    // eventfds of the open cursors, signalled after appends
+    size_t num_followers;
+};
+
+static struct memory_storage *to_memory(struct storage *storage)
+{
+    return (struct memory_storage *)storage;
+}
+
+// Queue one completed line made of the pending tail and @param size bytes at @param data.
+static int add_line(struct memory_storage *memory, size_t *num_lines, const char *data, size_t size)
+{
+    if (*num_lines == memory->lines_capacity)
+    {
+        size_t capacity = memory->lines_capacity > 0 ? memory->lines_capacity * 2 : 64;
+        struct aesd_buffer_entry *lines = realloc(memory->lines, capacity * sizeof(struct aesd_buffer_entry));
+        const char **evicted = realloc(memory->evicted, capacity * sizeof(const char *));
+        if (lines != NULL)
+        {
+            memory->lines = lines;
+        }
+        if (evicted != NULL)
+        {
+            memory->evicted = evicted;
+        }
+        if (lines == NULL || evicted == NULL)
+        {
+            return -1;
+        }
+        memory->lines_capacity = capacity;
+    }
+    char *line = malloc(memory->pending_size + size);
+    if (line == NULL)
+    {
+        return -1;
+    }
+    memcpy(line, memory->pending, memory->pending_size);
+    memcpy(line + memory->pending_size, data, size);
+    memory->lines[*num_lines] = (struct aesd_buffer_entry) { .buffptr = line, .size = memory->pending_size + size };
+    (*num_lines)++;
+    memory->pending_size = 0;
+    return 0;
+}
+
+static int keep_pending(struct memory_storage *memory, const char *data, size_t size)
+{
+    char *pending = realloc(memory->pending, memory->pending_size + size);
+    if (pending == NULL)
+    {
+        return -1;
+    }
+    memcpy(pending + memory->pending_size, data, size);
+    memory->pending = pending;
+    memory->pending_size += size;
+    return 0;
+}
+
+static void notify_followers(struct memory_storage *memory)
+{
+    pthread_mutex_lock(&memory->followers_mutex);
+    for (size_t i = 0; i < memory->num_followers; i++)
+    {
+        uint64_t one = 1;
+        if (write(memory->followers[i], &one, sizeof(one)) < 0)
+        {
+            // The counter is already non-zero, the follower will look
+        }
+    }
+    pthread_mutex_unlock(&memory->followers_mutex);
+}
+
+// Like the driver, every newline completes an entry and an unterminated tail waits for the
+// next write.  A packet that cannot be stored is dropped with everything after it.
+static int memory_append(struct storage *storage, struct iovec *iov, int count)
+{
+    struct memory_storage *memory = to_memory(storage);
+    size_t num_lines = 0;
+    int appended = 0;
+    for (; appended < count; appended++)
+    {
+        size_t packet_lines = num_lines;
+        const char *data = iov[appended].iov_base;
+        size_t size = iov[appended].iov_len;
+        const char *newline;
+        int rc = 0;
+        while (rc == 0 && (newline = memchr(data, '\n', size)) != NULL)
+        {
+            size_t line_size = newline - data + 1;
+            rc = add_line(memory, &num_lines, data, line_size);
+            data += line_size;
+            size -= line_size;
+        }
+        if (rc == 0 && size > 0)
+        {
+            rc = keep_pending(memory, data, size);
+        }
+        if (rc != 0)
+        {
+            // Nothing of the failed packet goes into the history
+            while (num_lines > packet_lines)
+            {
+                free((char *)memory->lines[--num_lines].buffptr);
+            }
+            memory->pending_size = 0;
+            break;
+        }
+    }
+
+    pthread_rwlock_wrlock(&memory->lock);
+    for (size_t i = 0; i < num_lines; i++)
+    {
+        // A full buffer overwrites its oldest entry, which is freed once the lock is dropped
+        struct aesd_circular_buffer *buffer = &memory->buffer;
+        memory->evicted[i] = buffer->full ? buffer->entry[buffer->in_offs].buffptr : NULL;
+        aesd_circular_buffer_add_entry(buffer, &memory->lines[i]);
+    }
+    pthread_rwlock_unlock(&memory->lock);
+
+    for (size_t i = 0; i < num_lines; i++)
+    {
+        free((char *)memory->evicted[i]);
+    }
+    if (num_lines > 0)
+    {
+        notify_followers(memory);
+    }
+    if (appended < count)
+    {
+        log_msg(LOG_ERR, "%s append memory allocation failed", storage->name);
+        errno = ENOMEM;
+    }
+    return appended;
+}
+
+static void memory_append_release(struct storage *storage)
+{
+    (void)storage;
+}
+
+// Copy from @param char_offset bytes past the oldest retained byte.  Called with the lock held.
+static size_t copy_history(struct memory_storage *memory, size_t char_offset, char *buffer, size_t size)
+{
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&memory->buffer, char_offset,
+                                                                                      &entry_offset);
+    size_t copied = 0;
+    while (entry != NULL && copied < size)
+    {
+        size_t num_chars = entry->size - entry_offset < size - copied ? entry->size - entry_offset : size - copied;
+        memcpy(buffer + copied, entry->buffptr + entry_offset, num_chars);
+        copied += num_chars;
+        entry_offset = 0;
+        entry = aesd_circular_buffer_next_entry(&memory->buffer, entry);
+    }
+    return copied;
+}
+
+static int memory_seekto(struct storage *storage, const struct aesd_seekto *seekto, off_t *offset)
+{
+    struct memory_storage *memory = to_memory(storage);
+    pthread_rwlock_rdlock(&memory->lock);
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(&memory->buffer, seekto->write_cmd);
+    if (entry == NULL || entry->size <= seekto->write_cmd_offset)
+    {
+        pthread_rwlock_unlock(&memory->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    *offset = entry->offset - aesd_circular_buffer_base_offset(&memory->buffer) + seekto->write_cmd_offset;
+    pthread_rwlock_unlock(&memory->lock);
+    return 0;
+}
+
+static ssize_t memory_read(struct storage *storage, off_t *offset, char *buffer, size_t size)
+{
+    struct memory_storage *memory = to_memory(storage);
+    pthread_rwlock_rdlock(&memory->lock);
+    size_t copied = copy_history(memory, *offset, buffer, size);
+    pthread_rwlock_unlock(&memory->lock);
+    *offset += copied;
+    return copied;
+}
+
+static int memory_file(struct storage *storage)
+{
+    (void)storage;
+    return -1;
+}
+
+static void memory_release_thread(struct storage *storage)
+{
+    (void)storage;
+}
+
+static int memory_cursor_open(struct storage *storage, struct storage_cursor *cursor)
+{
+    struct memory_storage *memory = to_memory(storage);
+    cursor->storage = storage;
+    cursor->exact = false;
+    cursor->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cursor->fd < 0)
+    {
+        log_msg(LOG_ERR, "eventfd error: %s", strerror(errno));
+        return -1;
+    }
+    cursor->poll_fd = cursor->fd;
+
+    pthread_mutex_lock(&memory->followers_mutex);
+    int *followers = realloc(memory->followers, (memory->num_followers + 1) * sizeof(int));
+    if (followers == NULL)
+    {
+        pthread_mutex_unlock(&memory->followers_mutex);
+        log_msg(LOG_ERR, "cursor memory allocation failed");
+        close(cursor->fd);
+        return -1;
+    }
+    memory->followers = followers;
+    memory->followers[memory->num_followers++] = cursor->fd;
+    pthread_mutex_unlock(&memory->followers_mutex);
+
+    pthread_rwlock_rdlock(&memory->lock);
+    cursor->position = memory->buffer.end_offset;
+    pthread_rwlock_unlock(&memory->lock);
+    return 0;
+}
+
+static int memory_cursor_readfrom(struct storage_cursor *cursor, const struct readfrom_request *request,
+                                  struct storage_range *range)
+{
+    struct memory_storage *memory = to_memory(cursor->storage);
+    pthread_rwlock_rdlock(&memory->lock);
+    storage_readfrom_range(request, aesd_circular_buffer_base_offset(&memory->buffer), memory->buffer.total_size,
+                           memory->epoch, range);
+    pthread_rwlock_unlock(&memory->lock);
+    cursor->position = range->start;
+    cursor->exact = true;
+    return 0;
+}
+
+static ssize_t memory_cursor_read(struct storage_cursor *cursor, char *buffer, size_t size)
+{
+    struct memory_storage *memory = to_memory(cursor->storage);
+    bool drained = false;
+    while (true)
+    {
+        pthread_rwlock_rdlock(&memory->lock);
+        size_t base = aesd_circular_buffer_base_offset(&memory->buffer);
+        if (cursor->position < base)
+        {
+            if (cursor->exact)
+            {
+                pthread_rwlock_unlock(&memory->lock);
+                errno = ESTALE;
+                return -1;
+            }
+            cursor->position = base;
+        }
+        if (cursor->position < memory->buffer.end_offset)
+        {
+            size_t copied = copy_history(memory, cursor->position - base, buffer, size);
+            pthread_rwlock_unlock(&memory->lock);
+            cursor->position += copied;
+            return copied;
+        }
+        pthread_rwlock_unlock(&memory->lock);
+
+        if (cursor->exact)
+        {
+            return 0;
+        }
+        if (drained)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        // Clear the wakeup before looking again, so an append after that look still wakes
+        // the poller
+        uint64_t value;
+        if (read(cursor->fd, &value, sizeof(value)) < 0)
+        {
+            // Nothing was signalled
+        }
+        drained = true;
+    }
+}
+
+static void memory_cursor_close(struct storage_cursor *cursor)
+{
+    struct memory_storage *memory = to_memory(cursor->storage);
+    pthread_mutex_lock(&memory->followers_mutex);
+    for (size_t i = 0; i < memory->num_followers; i++)
+    {
+        if (memory->followers[i] == cursor->fd)
+        {
+            memory->followers[i] = memory->followers[--memory->num_followers];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&memory->followers_mutex);
+    close(cursor->fd);
+}
+
+static void memory_destroy(struct storage *storage)
+{
+    struct memory_storage *memory = to_memory(storage);
+    for (size_t i = 0; i < aesd_circular_buffer_entry_count(&memory->buffer); i++)
+    {
+        free((char *)aesd_circular_buffer_entry_at(&memory->buffer, i)->buffptr);
+    }
+    free(memory->buffer.entry);
+    free(memory->pending);
+    free(memory->lines);
+    free(memory->evicted);
+    free(memory->followers);
+    pthread_mutex_destroy(&memory->followers_mutex);
+    pthread_rwlock_destroy(&memory->lock);
+    free(memory);
+}
+
+static const struct storage_ops memory_ops = {
+    .append = memory_append,
+    .append_release = memory_append_release,
+    .seekto = memory_seekto,
+    .read = memory_read,
+    .file = memory_file,
+    .release_thread = memory_release_thread,
+    .cursor_open = memory_cursor_open,
+    .cursor_readfrom = memory_cursor_readfrom,
+    .cursor_read = memory_cursor_read,
+    .cursor_close = memory_cursor_close,
+    .destroy = memory_destroy,
+};
+
+struct storage *storage_memory_open(const char *name, unsigned int index, size_t entries)
+{
+    struct memory_storage *memory = calloc(1, sizeof(struct memory_storage));
+    struct aesd_buffer_entry *storage_entries = calloc(entries, sizeof(struct aesd_buffer_entry));
+    if (memory == NULL || storage_entries == NULL)
+    {
+        log_msg(LOG_ERR, "storage memory allocation failed");
+        free(memory);
+        free(storage_entries);
+        return NULL;
+    }
+    memory->storage.ops = &memory_ops;
+    memory->storage.name = name;
+    memory->storage.index = index;
+    aesd_circular_buffer_init_storage(&memory->buffer, storage_entries, entries);
+    // Offsets restart at 0 with every server start, the epoch tells clients theirs are stale
+    if (getrandom(&memory->epoch, sizeof(memory->epoch), GRND_NONBLOCK) != sizeof(memory->epoch))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        memory->epoch = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec + index;
+    }
+
+    // Prefer the committer, otherwise a steady stream of read backs could hold appends off
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&memory->lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    pthread_mutex_init(&memory->followers_mutex, NULL);
+    return &memory->storage;
+}
@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include "subscription.h"
+#include "metrics.h"
+#include "log.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#define DEVICE_READ_SIZE (64 * 1024)
+
+struct subscriber {
+    struct connection_thread_args *connection;
+    /**
+     * Pushed bytes the socket has not accepted yet, from backlog_start to backlog_size
+     */
+    char *backlog;
+    size_t backlog_start;
+    size_t backlog_size;
+    size_t backlog_capacity;
+    /**
+     * Set once the socket failed or overflowed, the subscriber only waits for subscription_remove()
+     */
+    bool failed;
+    LIST_ENTRY(subscriber) entries;
+};
+
+/**
+ * The reader of one output storage and the subscribers it pushes to
+ */
+struct subscription_hub {
+    pthread_mutex_t mutex;  // protects subscribers, failed and stopping
+    LIST_HEAD(subscriber_head, subscriber) subscribers;
+    bool initialized;       // mutex and subscribers are set up, until subscription_stop_all()
+    bool started;           // the thread runs and the cursor is open
+    bool failed;            // the storage could not be read, the thread has exited
+    bool stopping;
+    pthread_t thread;
+    struct storage_cursor cursor;
+    int wakeup_pipe[2];     // wakes the thread when it has to stop
+};
+
+static struct subscription_hub hubs[MAX_OUTPUT_SHARDS];
+// Serializes starting and stopping hubs, and the add and remove calls that trigger it
+static pthread_mutex_t hubs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Disconnect a subscriber.  Shutting the socket down makes epoll report it so its worker
+// closes the connection, which removes the subscriber.
+static void subscriber_fail(struct subscriber *subscriber)
+{
+    subscriber->failed = true;
+    shutdown(subscriber->connection->client_fd, SHUT_RDWR);
+}
+
+// Send as much of the backlog as the socket takes without blocking.
+static void subscriber_flush(struct subscriber *subscriber)
+{
+    while (!subscriber->failed && subscriber->backlog_start < subscriber->backlog_size)
+    {
+        ssize_t sent_bytes = send(subscriber->connection->client_fd, subscriber->backlog + subscriber->backlog_start,
+                                  subscriber->backlog_size - subscriber->backlog_start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent_bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return;
+            }
+            subscriber_fail(subscriber);
+            return;
+        }
+        metrics_count(METRICS_BYTES_SENT, sent_bytes);
+        subscriber->backlog_start += sent_bytes;
+    }
+    subscriber->backlog_start = 0;
+    subscriber->backlog_size = 0;
+}
+
+// Send a line straight to the socket when nothing is queued ahead of it, queue what is left.
+static void subscriber_push(struct subscriber *subscriber, const char *data, size_t size)
+{
+    if (subscriber->failed)
+    {
+        return;
+    }
+    if (subscriber->backlog_size == 0)
+    {
+        ssize_t sent_bytes = send(subscriber->connection->client_fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent_bytes < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                subscriber_fail(subscriber);
+                return;
+            }
+            sent_bytes = 0;
+        }
+        metrics_count(METRICS_BYTES_SENT, sent_bytes);
+        data += sent_bytes;
+        size -= sent_bytes;
+        if (size == 0)
+        {
+            return;
+        }
+    }
+
+    size_t queued = subscriber->backlog_size - subscriber->backlog_start;
+    if (queued + size > SUBSCRIBER_MAX_BACKLOG)
+    {
+        log_ratelimited(LOG_INFO, "Dropping subscriber that fell %zu bytes behind", queued + size);
+        subscriber_fail(subscriber);
+        return;
+    }
+    if (subscriber->backlog_start > 0)
+    {
+        memmove(subscriber->backlog, subscriber->backlog + subscriber->backlog_start, queued);
+        subscriber->backlog_start = 0;
+        subscriber->backlog_size = queued;
+    }
+    if (subscriber->backlog_capacity - subscriber->backlog_size < size)
+    {
+        size_t capacity = subscriber->backlog_capacity > 0 ? subscriber->backlog_capacity : PACKET_BUFFER_INITIAL_CAPACITY;
+        while (capacity - subscriber->backlog_size < size)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(subscriber->backlog, capacity);
+        if (grown == NULL)
+        {
+            log_msg(LOG_ERR, "subscriber backlog memory allocation failed");
+            subscriber_fail(subscriber);
+            return;
+        }
+        subscriber->backlog = grown;
+        subscriber->backlog_capacity = capacity;
+    }
+    memcpy(subscriber->backlog + subscriber->backlog_size, data, size);
+    subscriber->backlog_size += size;
+}
+
+// Read everything the storage has committed since the last call.
+// Returns 0 once the read would block and -1 on error.
+static int read_storage(struct storage_cursor *cursor, struct packet_buffer *lines)
+{
+    while (true)
+    {
+        size_t available = 0;
+        char *buffer = packet_buffer_reserve(lines, DEVICE_READ_SIZE, &available);
+        if (buffer == NULL)
+        {
+            log_msg(LOG_ERR, "subscription memory allocation failed");
+            return -1;
+        }
+        ssize_t bytes_read = storage_cursor_read(cursor, buffer, available);
+        if (bytes_read > 0)
+        {
+            packet_buffer_commit(lines, bytes_read);
+            continue;
+        }
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return 0;
+        }
+        log_msg(LOG_ERR, "subscription read error: %s", bytes_read < 0 ? strerror(errno) : "end of file");
+        return -1;
+    }
+}
+
+static void *subscription_thread(void *thread_param)
+{
+    struct subscription_hub *hub = (struct subscription_hub *) thread_param;
+    struct packet_buffer lines;
+    packet_buffer_init(&lines);
+    struct pollfd *fds = NULL;
+    size_t fds_capacity = 0;
+
+    while (true)
+    {
+        // Watch the storage for new lines and every subscriber with queued output for space
+        pthread_mutex_lock(&hub->mutex);
+        if (hub->stopping)
+        {
+            pthread_mutex_unlock(&hub->mutex);
+            break;
+        }
+        size_t num_fds = 2;
+        struct subscriber *subscriber;
+        LIST_FOREACH(subscriber, &hub->subscribers, entries)
+        {
+            num_fds++;
+        }
+        if (num_fds > fds_capacity)
+        {
+            struct pollfd *grown = realloc(fds, num_fds * 2 * sizeof(struct pollfd));
+            if (grown == NULL)
+            {
+                pthread_mutex_unlock(&hub->mutex);
+                log_msg(LOG_ERR, "subscription memory allocation failed");
+                break;
+            }
+            fds = grown;
+            fds_capacity = num_fds * 2;
+        }
+        fds[0] = (struct pollfd) { .fd = hub->wakeup_pipe[0], .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = hub->cursor.poll_fd, .events = POLLIN };
+        num_fds = 2;
+        LIST_FOREACH(subscriber, &hub->subscribers, entries)
+        {
+            if (!subscriber->failed && subscriber->backlog_size > 0)
+            {
+                fds[num_fds++] = (struct pollfd) { .fd = subscriber->connection->client_fd, .events = POLLOUT };
+            }
+        }
+        pthread_mutex_unlock(&hub->mutex);
+
+        if (poll(fds, num_fds, -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                log_msg(LOG_ERR, "subscription poll error: %s", strerror(errno));
+            }
+            continue;
+        }
+        if (fds[0].revents != 0)
+        {
+            char wakeup[16];
+            while (read(hub->wakeup_pipe[0], wakeup, sizeof(wakeup)) > 0)
+            {
+            }
+        }
+        int status = 0;
+        if (fds[1].revents != 0)
+        {
+            status = read_storage(&hub->cursor, &lines);
+        }
+
+        // One read of the storage serves every subscriber
+        pthread_mutex_lock(&hub->mutex);
+        const char *line;
+        size_t line_size;
+        while (packet_buffer_next(&lines, &line, &line_size))
+        {
+            LIST_FOREACH(subscriber, &hub->subscribers, entries)
+            {
+                subscriber_push(subscriber, line, line_size);
+            }
+        }
+        LIST_FOREACH(subscriber, &hub->subscribers, entries)
+        {
+            if (status < 0)
+            {
+                subscriber_fail(subscriber);
+            }
+            subscriber_flush(subscriber);
+        }
+        hub->failed = status < 0;
+        pthread_mutex_unlock(&hub->mutex);
+        if (status < 0)
+        {
+            break;
+        }
+    }
+
+    free(fds);
+    packet_buffer_free(&lines);
+    return thread_param;
+}
+
+// Open a cursor at the end of the shard's storage and start its reader thread.
+// Called with hubs_mutex held.
+static int subscription_hub_start(struct subscription_hub *hub, struct storage *storage)
+{
+    if (storage_cursor_open(storage, &hub->cursor) != 0)
+    {
+        return -1;
+    }
+    if (pipe2(hub->wakeup_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        log_msg(LOG_ERR, "Subscription pipe error: %s", strerror(errno));
+        storage_cursor_close(&hub->cursor);
+        return -1;
+    }
+
+    hub->failed = false;
+    hub->stopping = false;
+    int rc = pthread_create(&hub->thread, NULL, subscription_thread, hub);
+    if (rc != 0)
+    {
+        log_msg(LOG_ERR, "pthread_create error: %s", strerror(rc));
+        close(hub->wakeup_pipe[0]);
+        close(hub->wakeup_pipe[1]);
+        storage_cursor_close(&hub->cursor);
+        return -1;
+    }
+    hub->started = true;
+    return 0;
+}
+
+// Join the reader thread and close the cursor, so nothing keeps the storage open while no one
+// subscribes.  Subscribers still listed stay, a later start serves them again.
+// Called with hubs_mutex held.
+static void subscription_hub_stop(struct subscription_hub *hub)
+{
+    pthread_mutex_lock(&hub->mutex);
+    hub->stopping = true;
+    pthread_mutex_unlock(&hub->mutex);
+    char wakeup = 0;
+    if (write(hub->wakeup_pipe[1], &wakeup, 1) < 0)
+    {
+        // Pipe already holds a pending wakeup
+    }
+    pthread_join(hub->thread, NULL);
+
+    close(hub->wakeup_pipe[0]);
+    close(hub->wakeup_pipe[1]);
+    storage_cursor_close(&hub->cursor);
+    hub->started = false;
+}
+
+int subscription_add(struct connection_thread_args *connection)
+{
+    struct subscription_hub *hub = &hubs[connection->shard];
+
+    struct subscriber *subscriber = calloc(1, sizeof(struct subscriber));
+    if (subscriber == NULL)
+    {
+        log_msg(LOG_ERR, "subscriber memory allocation failed");
+        return -1;
+    }
+    subscriber->connection = connection;
+
+    pthread_mutex_lock(&hubs_mutex);
+    if (!hub->initialized)
+    {
+        pthread_mutex_init(&hub->mutex, NULL);
+        LIST_INIT(&hub->subscribers);
+        hub->initialized = true;
+    }
+    // A hub whose storage read failed has exited, reap it and follow the storage afresh
+    if (hub->started)
+    {
+        pthread_mutex_lock(&hub->mutex);
+        bool failed = hub->failed;
+        pthread_mutex_unlock(&hub->mutex);
+        if (failed)
+        {
+            subscription_hub_stop(hub);
+        }
+    }
+    if (!hub->started && subscription_hub_start(hub, connection->storage) != 0)
+    {
+        pthread_mutex_unlock(&hubs_mutex);
+        free(subscriber);
+        return -1;
+    }
+
+    pthread_mutex_lock(&hub->mutex);
+    LIST_INSERT_HEAD(&hub->subscribers, subscriber, entries);
+    connection->subscribed = true;
+    pthread_mutex_unlock(&hub->mutex);
+    pthread_mutex_unlock(&hubs_mutex);
+
+    log_msg(LOG_INFO, "Connection subscribed to %s", connection->storage->name);
+    return 0;
+}
+
+void subscription_remove(struct connection_thread_args *connection)
+{
+    struct subscription_hub *hub = &hubs[connection->shard];
+
+    pthread_mutex_lock(&hubs_mutex);
+    pthread_mutex_lock(&hub->mutex);
+    struct subscriber *subscriber;
+    LIST_FOREACH(subscriber, &hub->subscribers, entries)
+    {
+        if (subscriber->connection == connection)
+        {
+            LIST_REMOVE(subscriber, entries);
+            free(subscriber->backlog);
+            free(subscriber);
+            break;
+        }
+    }
+    connection->subscribed = false;
+    bool idle = LIST_EMPTY(&hub->subscribers);
+    pthread_mutex_unlock(&hub->mutex);
+
+    if (idle && hub->started)
+    {
+        subscription_hub_stop(hub);
+    }
+    pthread_mutex_unlock(&hubs_mutex);
+}
+
+void subscription_stop_all(void)
+{
+    pthread_mutex_lock(&hubs_mutex);
+    for (size_t i = 0; i < MAX_OUTPUT_SHARDS; i++)
+    {
+        struct subscription_hub *hub = &hubs[i];
+        if (!hub->initialized)
+        {
+            continue;
+        }
+        if (hub->started)
+        {
+            subscription_hub_stop(hub);
+        }
+        pthread_mutex_destroy(&hub->mutex);
+        hub->initialized = false;
+    }
+    pthread_mutex_unlock(&hubs_mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef SUBSCRIPTION_H
+#define SUBSCRIPTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "connection_thread.h"
+
+// Bytes a subscriber may fall behind before it is disconnected
+#define SUBSCRIBER_MAX_BACKLOG (1024 * 1024)
+
+/**
+ * Streaming subscriptions.  Each output storage gets at most one reader thread, started by the
+ * first subscriber on that storage, which follows it with a cursor and pushes every newly
+ * completed line to all of its subscribers.  Subscribers never read the storage themselves.
+ * The thread is joined and the cursor closed when the last subscriber leaves.  When the
+ * storage cannot be read every subscriber is shut down, and the next subscriber starts over.
+ * A subscriber that cannot keep up is shut down once SUBSCRIBER_MAX_BACKLOG bytes are queued.
+ */
+
+/**
+ * Start pushing new lines of the connection's output storage to @param connection.
+ * From then on only the subscription thread sends on the connection's socket.
+ * @return 0 on success, -1 if the storage could not be followed.
+ */
+int subscription_add(struct connection_thread_args *connection);
+
+/**
+ * Stop pushing to @param connection.  Must be called before its socket is closed.
+ * May join the subscription thread, so it must not be called from it.
+ */
+void subscription_remove(struct connection_thread_args *connection);
+
+/**
+ * Stop every subscription thread.  Subscribers must have been removed already.
+ */
+void subscription_stop_all(void);
+
+#endif
@@ -0,0 +1,131 @@
+#include "worker_pool.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+// Wait for work, running the idle handler once the worker has had none for the idle timeout.
+// Called and returns with queue_mutex held.
+static void wait_for_work(struct worker_pool *pool)
+{
+    bool idle_handled = pool->idle_handler == NULL;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += WORKER_POOL_IDLE_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (WORKER_POOL_IDLE_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (!pool->stopping && STAILQ_EMPTY(&pool->queue))
+    {
+        if (idle_handled)
+        {
+            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+            continue;
+        }
+        if (pthread_cond_timedwait(&pool->queue_cond, &pool->queue_mutex, &deadline) == ETIMEDOUT &&
+            !pool->stopping && STAILQ_EMPTY(&pool->queue))
+        {
+            pthread_mutex_unlock(&pool->queue_mutex);
+            pool->idle_handler(pool->context);
+            pthread_mutex_lock(&pool->queue_mutex);
+            idle_handled = true;
+        }
+    }
+}
+
+static void* worker_thread(void* thread_param)
+{
+    struct worker_pool *pool = (struct worker_pool *) thread_param;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->queue_mutex);
+        wait_for_work(pool);
+        if (pool->stopping)
+        {
+            pthread_mutex_unlock(&pool->queue_mutex);
+            break;
+        }
+        struct connection_thread_args *connection = STAILQ_FIRST(&pool->queue);
+        STAILQ_REMOVE_HEAD(&pool->queue, queue_entries);
+        pthread_mutex_unlock(&pool->queue_mutex);
+
+        pool->handler(connection, pool->context);
+    }
+
+    if (pool->idle_handler != NULL)
+    {
+        pool->idle_handler(pool->context);
+    }
+    return thread_param;
+}
+
+int worker_pool_init(struct worker_pool *pool, size_t num_threads, worker_pool_handler handler,
+                     worker_pool_idle_handler idle_handler, void *context)
+{
+    memset(pool, 0, sizeof(struct worker_pool));
+    pool->handler = handler;
+    pool->idle_handler = idle_handler;
+    pool->context = context;
+    STAILQ_INIT(&pool->queue);
+    pthread_mutex_init(&pool->queue_mutex, NULL);
+    // Idle timeouts are measured on the monotonic clock so clock changes do not affect them
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->queue_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    if (pool->threads == NULL)
+    {
+        log_msg(LOG_ERR, "worker pool memory allocation failed");
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_threads; i++)
+    {
+        int rc = pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+        if (rc != 0)
+        {
+            log_msg(LOG_ERR, "pthread_create error: %s", strerror(rc));
+            worker_pool_stop(pool);
+            return -1;
+        }
+        pool->num_threads++;
+    }
+
+    return 0;
+}
+
+void worker_pool_submit(struct worker_pool *pool, struct connection_thread_args *connection)
+{
+    pthread_mutex_lock(&pool->queue_mutex);
+    STAILQ_INSERT_TAIL(&pool->queue, connection, queue_entries);
+    pthread_cond_signal(&pool->queue_cond);
+    pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+void worker_pool_stop(struct worker_pool *pool)
+{
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queue_cond);
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    for (size_t i = 0; i < pool->num_threads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->num_threads = 0;
+    free(pool->threads);
+    pool->threads = NULL;
+
+    pthread_cond_destroy(&pool->queue_cond);
+    pthread_mutex_destroy(&pool->queue_mutex);
+}
@@ -0,0 +1,57 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "connection_thread.h"
+
+#define WORKER_POOL_DEFAULT_THREADS 4
+#define WORKER_POOL_MAX_THREADS 256
+// How long a worker waits without work before its idle handler runs
+#define WORKER_POOL_IDLE_TIMEOUT_MS 1000
+
+typedef void (*worker_pool_handler)(struct connection_thread_args *connection, void *context);
+typedef void (*worker_pool_idle_handler)(void *context);
+
+/**
+ * A fixed set of threads servicing connections handed over by the event loop.
+ * Connections are queued FIFO; each one is processed by exactly one worker at a time.
+ */
+struct worker_pool {
+    pthread_t *threads;
+    size_t num_threads;
+    worker_pool_handler handler;
+    worker_pool_idle_handler idle_handler;
+    void *context;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    STAILQ_HEAD(worker_queue, connection_thread_args) queue;
+    bool stopping;
+};
+
+/**
+ * Start @param num_threads workers which call @param handler with @param context for every
+ * connection passed to worker_pool_submit().
+ * @param idle_handler, if not NULL, runs on a worker thread once it has had no work for
+ * WORKER_POOL_IDLE_TIMEOUT_MS, and again before it exits, so per-thread resources can be
+ * released while the server is quiet.  It runs at most once per idle period.
+ * @return 0 on success, -1 if the pool could not be started.
+ */
+int worker_pool_init(struct worker_pool *pool, size_t num_threads, worker_pool_handler handler,
+                     worker_pool_idle_handler idle_handler, void *context);
+
+/**
+ * Queue @param connection to be handled by the next idle worker.
+ */
+void worker_pool_submit(struct worker_pool *pool, struct connection_thread_args *connection);
+
+/**
+ * Stop accepting work, wake every worker and join them.  Connections still queued are left
+ * in the queue for the caller to release.
+ */
+void worker_pool_stop(struct worker_pool *pool);
+
+#endif